@@ -38,4 +38,21 @@ pub fn build(b: *std.Build) void {
 
         b.installArtifact(bandwidth);
     }
+
+    {
+        const c2c = b.addExecutable(.{
+            .name = "c2c",
+            .root_source_file = .{
+                .path = "src/c2c.cpp",
+            },
+            .target = target,
+            .optimize = optimize,
+        });
+        c2c.linkLibC();
+        c2c.linkLibCpp();
+        c2c.addIncludePath(.{ .path = "src" });
+        c2c.addIncludePath(.{ .path = "lib/cxxopts" });
+
+        b.installArtifact(c2c);
+    }
 }
@@ -1,25 +1,326 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <map>
+#include <thread>
+#include <vector>
 
 #include <cxxopts.hpp>
 
+#include "bandwidth/buffer.hpp"
+#include "bandwidth/kernels.hpp"
+#include "bandwidth/latency.hpp"
+#include "bandwidth/patterns.hpp"
+#include "bandwidth/threads.hpp"
+#include "measure.hpp"
 #include "timeit.hpp"
 #include "utils.hpp"
 
-// Allocate 1GB of memory
-u8 u8data[1 << 29];
-u8 u8data2[1 << 29];
+// Keeps the results of the read kernels alive. Only the main thread writes
+// it; the workers of run_scaling() keep their own sums.
+volatile f64 sink;
+
+// Operations of the single-threaded sweep, in the order of sweep_kernels()
+const char *KERNEL_OPS[] = {
+    "read",     "write",    "copy",   "scale",   "add",     "triad",
+    "write_nt", "copy_nt", "scale_nt", "add_nt", "triad_nt",
+};
+
+// Every kernel of a sweep step. Each one touches `k` words in total over
+// its arrays, so the same size in bytes divides all of them.
+inline auto sweep_kernels(const Kernels &kern, f64 *data, f64 *temp, u64 k)
+    -> std::vector<std::function<void()>> {
+  u64 n2 = k / 2, n3 = k / 3;
+  f64 *c = data + n3;
+  return {
+      [=]() { sink = sink + kern.read(data, k); },
+      [=]() { kern.write(data, 1.0, k); },
+      [=]() { kern.copy(temp, data, n2); },
+      [=]() { kern.scale(temp, data, 3.0, n2); },
+      [=]() { kern.add(temp, data, c, n3); },
+      [=]() { kern.triad(temp, data, c, 3.0, n3); },
+      [=]() { kern.write_nt(data, 1.0, k); },
+      [=]() { kern.copy_nt(temp, data, n2); },
+      [=]() { kern.scale_nt(temp, data, 3.0, n2); },
+      [=]() { kern.add_nt(temp, data, c, n3); },
+      [=]() { kern.triad_nt(temp, data, c, 3.0, n3); },
+  };
+}
+
+// The size sweep, in u64 words: steps of 1/8 up to 512 KiB, then of 1/4
+inline auto next_size(u64 k) -> u64 {
+  return k + (k < (1 << 16) ? (k >> 3) : (k >> 2));
+}
+
+inline auto repeats(u64 k) -> u32 { return k < (1 << 16) ? 20000 : 100; }
+
+struct Interval {
+  u64 start;
+  u64 end;
+};
+
+// GB/s of `bytes` moved by the threads in `ids` during their intervals
+inline auto gbps(const std::vector<Interval> &times,
+                 const std::vector<u32> &ids, u64 bytes) -> f64 {
+  u64 start = UINT64_MAX, end = 0;
+  for (u32 i : ids) {
+    start = times[i].start < start ? times[i].start : start;
+    end = times[i].end > end ? times[i].end : end;
+  }
+  return end > start ? (f64)bytes * ids.size() / (end - start) : 0.0;
+}
+
+// Run the size sweep with 1..max_threads threads, thread i pinned to
+// cpus[i] and working on buffers it touched first, so they are local to its
+// NUMA node. All threads start every measurement at a barrier. The threads
+// share `max_words`: with n threads each sweeps up to max_words / n, so the
+// run needs no more memory than the single-threaded sweep.
+auto run_scaling(const Kernels &kern, const std::vector<int> &cpus,
+                 u32 max_threads, bool numa, u64 max_words, PageMode pages,
+                 FILE *fp) -> void {
+  fprintf(fp, "threads,thread,cpu,node,size,read,write,kernel\n");
+
+  for (u32 n = 1; n <= max_threads; ++n) {
+    u64 words = max_words / n;
+    SpinBarrier barrier(n);
+    std::vector<Interval> reads(n), writes(n);
+    std::vector<TouchCost> touches(n);
+    std::vector<f64> sums(n);
+    // Threads of each node, for --numa
+    std::map<int, std::vector<u32>> nodes;
+    std::vector<u32> all;
+    for (u32 i = 0; i < n; ++i) {
+      nodes[cpu_node(cpus[i])].push_back(i);
+      all.push_back(i);
+    }
+
+    auto report = [&](u64 k) {
+      u64 bytes = k * sizeof(u64) * repeats(k);
+      for (u32 i = 0; i < n; ++i) {
+        fprintf(fp, "%u,%u,%d,%d,%lu,%.3f,%.3f,%s\n", n, i, cpus[i],
+                cpu_node(cpus[i]), k << 3, gbps(reads, {i}, bytes),
+                gbps(writes, {i}, bytes), kern.name);
+      }
+      if (numa) {
+        for (auto &pair : nodes) {
+          fprintf(fp, "%u,-1,-1,%d,%lu,%.3f,%.3f,%s\n", n, pair.first,
+                  k << 3, gbps(reads, pair.second, bytes),
+                  gbps(writes, pair.second, bytes), kern.name);
+        }
+      }
+      f64 read = gbps(reads, all, bytes);
+      f64 write = gbps(writes, all, bytes);
+      fprintf(fp, "%u,-1,-1,-1,%lu,%.3f,%.3f,%s\n", n, k << 3, read, write,
+              kern.name);
+      printf("===== %u threads, %lu =====\n", n, k << 3);
+      printf("Read: %.3f GB/s\n", read);
+      printf("Write: %.3f GB/s\n", write);
+    };
+
+    auto worker = [&](u32 id) {
+      if (!pin_to_cpu(cpus[id])) {
+        printf("CSPM: [ERROR] Cannot pin thread %u to CPU %d\n", id, cpus[id]);
+      }
+      Buffer buf(words * sizeof(f64), pages);
+      f64 *data = (f64 *)buf.data();
+      // First touch places the pages on this thread's node
+      barrier.wait();
+      touches[id] = buf.touch();
+      barrier.wait();
+      if (id == 0) {
+        for (u32 i = 0; i < n; ++i) {
+          char what[64];
+          snprintf(what, sizeof(what), "%u threads, thread %u", n, i);
+          print_touch(what, touches[i]);
+        }
+      }
+
+      f64 sum = 0;
+      for (u64 k = (1 << 6); k < words; k = next_size(k)) {
+        u32 reps = repeats(k);
+
+        barrier.wait();
+        reads[id].start = monotonic_ns();
+        for (u32 i = 0; i < reps; ++i) {
+          sum += kern.read(data, k);
+        }
+        reads[id].end = monotonic_ns();
+
+        barrier.wait();
+        writes[id].start = monotonic_ns();
+        for (u32 i = 0; i < reps; ++i) {
+          kern.write(data, 1.0, k);
+        }
+        writes[id].end = monotonic_ns();
+
+        // Thread 0 reports while the others wait at the next barrier
+        barrier.wait();
+        if (id == 0) {
+          report(k);
+        }
+      }
+      sums[id] = sum;
+    };
+
+    std::vector<std::thread> threads;
+    for (u32 i = 1; i < n; ++i) {
+      threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    for (f64 sum : sums) {
+      sink = sink + sum;
+    }
+  }
+}
+
+// Every pattern over the size sweep, one row per pattern and size. The
+// samples of a measurement repeat passes until they made at least 4M
+// accesses together; the rows have the median ns per access with its 95% CI
+// and the GB/s of the words accessed.
+auto run_patterns(const std::vector<Pattern> &patterns, u64 max_words,
+                  PageMode pages, MeasureConfig config, FILE *fp) -> void {
+  Buffer data_buf(max_words * sizeof(u64), pages);
+  Buffer temp_buf(max_words * sizeof(u64), pages);
+  print_touch("data", data_buf.touch());
+  print_touch("temp", temp_buf.touch());
+
+  std::mt19937_64 rng(42);
+  std::vector<u32> index = make_index(INDEX_LEN, rng);
+  PatternArgs args = {(u64 *)data_buf.data(), (u64 *)temp_buf.data(),
+                      index.data(), index.size(), 0};
+
+  fprintf(fp, "size,pattern,accesses,ns,ci_low_ns,ci_high_ns,gbps\n");
+  for (u64 k = (1 << 6); k < max_words; k = next_size(k)) {
+    printf("===== %lu =====\n", k << 3);
+    for (const Pattern &pattern : patterns) {
+      // Accesses of one pass, which also warms the caches and TLBs
+      u64 per_pass = pattern.pass(args, k);
+      if (per_pass == 0) {
+        continue;
+      }
+      u64 passes = (1 << 22) / per_pass / config.reps;
+      config.batch = passes ? passes : 1;
+      Stats stats = measure([&]() { pattern.pass(args, k); }, config);
+
+      u64 accesses = per_pass * config.batch * config.reps;
+      f64 ns = stats.median / per_pass;
+      f64 rate = sizeof(u64) / ns;
+      printf("%s: %.3f ns, %.3f GB/s\n", pattern.name.c_str(), ns, rate);
+      fprintf(fp, "%lu,%s,%lu,%.3f,%.3f,%.3f,%.3f\n", k << 3,
+              pattern.name.c_str(), accesses, ns, stats.ci_low / per_pass,
+              stats.ci_high / per_pass, rate);
+    }
+  }
+  sink = sink + args.sum;
+}
+
+// Latency of a random pointer chase over working sets from 4 KiB up to
+// `max_size`, four sizes per octave, once per cache line and once per page
+auto run_latency(u64 max_size, u64 hops, PageMode page_mode,
+                 MeasureConfig config, FILE *fp,
+                 const std::string &caches_path) -> void {
+  Buffer buffer(max_size, page_mode);
+  print_touch("latency", buffer.touch());
+  u8 *buf = buffer.data();
+
+  std::mt19937_64 rng(42);
+  std::vector<LatencyPoint> lines, pages;
+  fprintf(fp, "size,ns,tlb_ns\n");
+  for (u64 octave = PAGE_SIZE; octave <= max_size; octave *= 2) {
+    for (f64 step : {1.0, 1.1892, 1.4142, 1.6818}) {
+      u64 size = (u64)(octave * step) & ~(CACHE_LINE - 1);
+      if (size > max_size) {
+        break;
+      }
+      f64 line_ns = measure_latency(buf, size, false, hops, rng, config);
+      f64 page_ns = measure_latency(buf, size, true, hops, rng, config);
+      lines.push_back({size, line_ns});
+      if (page_ns > 0) {
+        pages.push_back({size, page_ns});
+      }
+
+      printf("===== %lu =====\n", size);
+      printf("Latency: %.2f ns\n", line_ns);
+      printf("TLB: %.2f ns\n", page_ns);
+      fprintf(fp, "%lu,%.3f,%.3f\n", size, line_ns, page_ns);
+    }
+  }
+
+  std::vector<u64> cache_steps = find_steps(lines);
+  std::vector<u64> tlb_steps = find_steps(pages);
+  printf("Caches (latency curve):");
+  for (u64 size : cache_steps) {
+    printf(" %lu KiB", size >> 10);
+  }
+  printf("\nTLB reach (latency curve):");
+  for (u64 size : tlb_steps) {
+    printf(" %lu KiB", size >> 10);
+  }
+  printf("\nCaches (/sys):");
+  for (const CacheInfo &cache : read_sys_caches()) {
+    printf(" L%u %s %lu KiB", cache.level, cache.type.c_str(),
+           cache.size >> 10);
+  }
+  printf("\n");
+  write_caches(caches_path, cache_steps, tlb_steps);
+}
+
+// bandwidth.csv -> bandwidth.caches.csv
+inline auto caches_path_of(const std::string &output) -> std::string {
+  std::string base = output;
+  if (base.size() > 4 && base.compare(base.size() - 4, 4, ".csv") == 0) {
+    base.resize(base.size() - 4);
+  }
+  return base + ".caches.csv";
+}
 
 auto main(int argc, char **argv) -> int {
   cxxopts::Options options("bandwidth",
                            "Test bandwidth between CPU and Memory/Cache");
 
   std::string output_file;
+  u32 threads;
+  std::string cores;
+  bool numa;
+  u64 max_size;
+  std::string kernel_name;
+  std::string mode;
+  u64 hops;
+  std::string page_name;
+  std::string pattern_list;
+  u32 warmup;
+  u32 reps;
 
   // clang-format off
     options.add_options()
       ("h,help", "Print help")
       ("o,output", "Output file", cxxopts::value(output_file)->default_value("bandwidth.csv"))
+      ("t,threads", "Run the sweep with 1..N threads, each pinned to a core (default: 0, one unpinned thread)",
+      cxxopts::value(threads)->default_value("0"))
+      ("c,cores", "CPUs to pin the threads to, in order, e.g. 0-3,8 (default: all allowed CPUs)",
+      cxxopts::value(cores)->default_value(""))
+      ("numa", "Also report the aggregate bandwidth of every NUMA node",
+      cxxopts::value(numa)->default_value("false"))
+      ("s,max-size", "Largest buffer of the sweep in bytes, allocated at runtime, shared by the threads of --threads (default: 536870912)",
+      cxxopts::value(max_size)->default_value("536870912"))
+      ("k,kernel", "Kernel set (auto, sse2, avx2, avx512) (default: auto, the widest this CPU supports)",
+      cxxopts::value(kernel_name)->default_value("auto"))
+      ("m,mode", "What to measure (bandwidth, latency, patterns) (default: bandwidth)",
+      cxxopts::value(mode)->default_value("bandwidth"))
+      ("hops", "Dependent loads per latency measurement (default: 4194304)",
+      cxxopts::value(hops)->default_value("4194304"))
+      ("p,pages", "Pages of the buffers (4k, thp for transparent huge pages, 2m or 1g for reserved huge pages) (default: 4k)",
+      cxxopts::value(page_name)->default_value("4k"))
+      ("patterns", "Access patterns of --mode patterns: stride, strideB, random, rmw, mix, mixN:M (default: stride,random,rmw,mix)",
+      cxxopts::value(pattern_list)->default_value("stride,random,rmw,mix"))
+      ("warmup", "Untimed samples before every measurement (default: 2)",
+      cxxopts::value(warmup)->default_value("2"))
+      ("r,reps", "Timed samples per measurement (default: 20)",
+      cxxopts::value(reps)->default_value("20"))
     ;
   // clang-format on
 
@@ -30,41 +331,107 @@ auto main(int argc, char **argv) -> int {
     return 0;
   }
 
-  u64 *data = (u64 *)u8data;
-  u64 *temp = (u64 *)u8data2;
+  if (mode != "bandwidth" && mode != "latency" && mode != "patterns") {
+    printf("CSPM: [ERROR] Unknown mode: %s\n", mode.c_str());
+    return 1;
+  }
+
+  PageMode pages;
+  if (!parse_page_mode(page_name, pages)) {
+    printf("CSPM: [ERROR] Unknown page size: %s\n", page_name.c_str());
+    return 1;
+  }
+  u64 max_words = max_size / sizeof(u64);
+
+  std::vector<Pattern> patterns;
+  if (mode == "patterns" && !parse_patterns(pattern_list, patterns)) {
+    printf("CSPM: [ERROR] Invalid pattern list: %s\n", pattern_list.c_str());
+    return 1;
+  }
+
+  const Kernels *kern = find_kernels(kernel_name);
+  if (!kern) {
+    printf("CSPM: [ERROR] Kernel %s is unknown or not supported (best: %s)\n",
+           kernel_name.c_str(), detect_kernels().name);
+    return 1;
+  }
+  if (reps == 0) {
+    printf("CSPM: [ERROR] --reps must be positive\n");
+    return 1;
+  }
+  printf("Kernel: %s\n", kern->name);
+  print_clock();
 
   // Open file
   FILE *fp = fopen(output_file.c_str(), "w");
-  fprintf(fp, "size,read,write\n");
+  if (!fp) {
+    perror("CSPM: [ERROR] Cannot open output file ");
+    return 1;
+  }
 
-  for (u64 k = (1 << 6); k < (1 << 26);
-       k += k < (1 << 16) ? (k >> 3) : (k >> 2)) {
-    printf("===== %lu =====\n", k << 3);
+  // Cache sizes of this machine next to the results, for the plots
+  std::string caches_path = caches_path_of(output_file);
+  if (mode == "latency") {
+    run_latency(max_size, hops, pages, {warmup, reps, 1}, fp, caches_path);
+    fclose(fp);
+    return 0;
+  }
+  write_caches(caches_path, {}, {});
 
-    u64 read_us = 0;
-    u64 write_us = 0;
+  if (mode == "patterns") {
+    run_patterns(patterns, max_words, pages, {warmup, reps, 1}, fp);
+    fclose(fp);
+    return 0;
+  }
 
-    u64 us = timeit_rdtsc([&]() {
-      for (u16 i = 0; i < (k < (1 << 16) ? 20000 : 100); ++i) {
-        memcpy(temp, data, (k >> 1) * sizeof(u64));
-      }
-    });
-    read_us = us / (k < (1 << 16) ? 20000 : 100);
+  if (threads > 0) {
+    std::vector<int> cpus;
+    if (cores.empty()) {
+      cpus = allowed_cpus();
+    } else if (!parse_cpu_list(cores, cpus)) {
+      printf("CSPM: [ERROR] Invalid CPU list: %s\n", cores.c_str());
+      return 1;
+    }
+    if (cpus.size() < threads) {
+      printf("CSPM: [ERROR] %u threads but only %lu CPUs\n", threads,
+             cpus.size());
+      return 1;
+    }
+    run_scaling(*kern, cpus, threads, numa, max_words, pages, fp);
+    fclose(fp);
+    return 0;
+  }
 
-    us = timeit_rdtsc([&]() {
-      for (u16 i = 0; i < (k < (1 << 16) ? 20000 : 100); ++i) {
-        memset(data, 1, k * sizeof(u64));
-      }
-    });
-    write_us = us / (k < (1 << 16) ? 20000 : 100);
+  // Fault the buffers in before the sweep, so no kernel pays for it
+  Buffer data_buf(max_size, pages);
+  Buffer temp_buf(max_size, pages);
+  print_touch("data", data_buf.touch());
+  print_touch("temp", temp_buf.touch());
+  f64 *data = (f64 *)data_buf.data();
+  f64 *temp = (f64 *)temp_buf.data();
 
-    printf("\n");
-    printf("Read: %lu c\n", read_us);
-    printf("Write: %lu c\n", write_us);
+  // ns per pass over `k` words; every kernel moves 8k bytes per pass
+  fprintf(fp, "size,op,min_ns,median_ns,p99_ns,ci_low_ns,ci_high_ns,outliers,"
+              "gbps,kernel\n");
+  for (u64 k = (1 << 6); k < max_words; k = next_size(k)) {
+    printf("===== %lu =====\n", k << 3);
 
-    // Write to file
-    fprintf(fp, "%lu,%lu,%lu\n", k << 3, read_us, write_us);
+    std::vector<std::function<void()>> steps =
+        sweep_kernels(*kern, data, temp, k);
+    // Split the passes of a size over the samples
+    u64 batch = repeats(k) / reps ? repeats(k) / reps : 1;
+    for (size_t i = 0; i < steps.size(); ++i) {
+      Stats stats = measure(steps[i], {warmup, reps, batch});
+      f64 rate = (k << 3) / stats.median;
+      char name[64];
+      snprintf(name, sizeof(name), "%s (%.3f GB/s)", KERNEL_OPS[i], rate);
+      print_stats(name, stats);
+      fprintf(fp, "%lu,%s,%.3f,%.3f,%.3f,%.3f,%.3f,%lu,%.3f,%s\n", k << 3,
+              KERNEL_OPS[i], stats.min, stats.median, stats.p99, stats.ci_low,
+              stats.ci_high, stats.outliers, rate, kern->name);
+    }
   }
 
+  fclose(fp);
   return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 import csv
 import argparse
+import os
 
 import polars as pl
 import matplotlib.pyplot as plt
@@ -19,36 +20,95 @@ parser.add_argument(
     type=str,
 )
 
+parser.add_argument(
+    "--caches",
+    help="Cache sizes written by bandwidth (default: <input>.caches.csv)",
+    default=None,
+    type=str,
+)
+
 args = parser.parse_args()
 
+caches_file = args.caches
+if caches_file is None:
+    base = args.input_file
+    if base.endswith(".csv"):
+        base = base[: -len(".csv")]
+    caches_file = base + ".caches.csv"
+
 # Read the CSV file
 #
-# size(Byte), read(us), write(us)
+# Bandwidth: size(Byte), op, min_ns, median_ns, p99_ns, ci_low_ns, ci_high_ns,
+#   outliers, gbps, kernel (times per pass over size bytes)
+# Latency: size(Byte), ns, tlb_ns
+# Patterns: size(Byte), pattern, accesses, ns, ci_low_ns, ci_high_ns, gbps
+#   (median ns per access)
+# Scaling: threads, thread, cpu, node, size(Byte), read, write, kernel (GB/s;
+#   thread -1 are the aggregates of a node, or of all threads with node -1)
 data = pl.read_csv(args.input_file)
+patterns = "pattern" in data.columns
+latency = "ns" in data.columns and not patterns
+scaling = "threads" in data.columns
 
-data = data.select(
-    "size",
-    (pl.col("size") / pl.col("read") * 2.1).alias("read"),
-    (pl.col("size") / pl.col("write") * 2.1).alias("write"),
-)
-
-# Plot the data
 fig, ax = plt.subplots()
-ax.plot(data["size"], data["read"], label="Read", marker=".")
-ax.plot(data["size"], data["write"], label="Write", marker=".")
+if latency:
+    ax.plot(data["size"], data["ns"], label="Cache line", marker=".")
+    ax.plot(data["size"], data["tlb_ns"], label="Page (TLB)", marker=".")
+elif patterns:
+    for name in data["pattern"].unique(maintain_order=True):
+        rows = data.filter(pl.col("pattern") == name)
+        ax.plot(rows["size"], rows["gbps"], label=name, marker=".")
+elif scaling:
+    # Aggregate of all threads, one curve per thread count and operation
+    total = data.filter((pl.col("thread") == -1) & (pl.col("node") == -1))
+    for n in total["threads"].unique(maintain_order=True):
+        rows = total.filter(pl.col("threads") == n)
+        for op in ["read", "write"]:
+            ax.plot(rows["size"], rows[op], label=f"{op}, {n} threads", marker=".")
+else:
+    # Median with its 95% CI as a band; the times are real time already
+    for name in data["op"].unique(maintain_order=True):
+        rows = data.filter(pl.col("op") == name)
+        ax.plot(rows["size"], rows["gbps"], label=name, marker=".")
+        ax.fill_between(
+            rows["size"],
+            rows["size"] / rows["ci_high_ns"],
+            rows["size"] / rows["ci_low_ns"],
+            alpha=0.2,
+        )
 
-# Add vertical lines for L1, L2, L3 cache sizes
-# L1: 32KB
-# L2: 1MB
-# L3: 27.5MB
-ax.axvline(x=32 * 1024, color="black", linestyle=":")
-ax.axvline(x=1024 * 1024, color="black", linestyle=":")
-ax.axvline(x=27.5 * 1024 * 1024, color="black", linestyle=":")
+# Vertical lines at the cache sizes of the machine that produced the data:
+# dotted from /sys, dashed where the latency curve steps up
+if os.path.exists(caches_file):
+    caches = pl.read_csv(caches_file)
+    for row in caches.iter_rows(named=True):
+        if row["source"] == "sys" and row["type"] != "Instruction":
+            ax.axvline(x=row["size"], color="black", linestyle=":")
+            ax.annotate(
+                f"L{row['level']}",
+                (row["size"], 1),
+                xycoords=("data", "axes fraction"),
+                va="top",
+            )
+        elif row["source"] == "latency":
+            ax.axvline(x=row["size"], color="gray", linestyle="--")
 
 ax.set_xlabel("Array Size (Byte)")
 ax.set_xscale("log", base=2)
-ax.set_ylabel("Bandwidth (GB/s)")
-# ax.set_yscale("log", base=10)
-ax.set_title("Bandwidth")
-ax.legend()
+if latency:
+    ax.set_ylabel("Latency (ns)")
+    ax.set_yscale("log", base=10)
+    ax.set_title("Latency")
+elif patterns:
+    ax.set_ylabel("Bandwidth of the accessed words (GB/s)")
+    ax.set_yscale("log", base=10)
+    ax.set_title("Access patterns")
+elif scaling:
+    ax.set_ylabel("Aggregate bandwidth (GB/s)")
+    ax.set_title("Thread scaling")
+else:
+    ax.set_ylabel("Bandwidth (GB/s)")
+    # ax.set_yscale("log", base=10)
+    ax.set_title("Bandwidth")
+ax.legend(fontsize="small")
 plt.savefig(args.output_file)
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "timeit.hpp"
+#include "utils.hpp"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+enum class PageMode {
+  Small,       // 4 KiB pages, transparent huge pages disabled
+  Transparent, // madvise(MADV_HUGEPAGE), 2 MiB where the kernel can
+  Huge2M,      // MAP_HUGETLB from the reserved 2 MiB pool
+  Huge1G,      // MAP_HUGETLB from the reserved 1 GiB pool
+};
+
+// "4k", "thp", "2m" or "1g"
+inline auto parse_page_mode(const std::string &name, PageMode &mode) -> bool {
+  if (name == "4k") {
+    mode = PageMode::Small;
+  } else if (name == "thp") {
+    mode = PageMode::Transparent;
+  } else if (name == "2m") {
+    mode = PageMode::Huge2M;
+  } else if (name == "1g") {
+    mode = PageMode::Huge1G;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// What first touching a buffer cost
+struct TouchCost {
+  u64 bytes;
+  u64 ns;
+  // Minor faults taken by the calling thread
+  u64 faults;
+};
+
+// An anonymous mapping for the benchmarks, allocated at runtime so its size
+// and page size can be chosen. Nothing is mapped until touch().
+class Buffer {
+public:
+  Buffer(u64 size, PageMode mode) : mode(mode) {
+    u64 page = page_size();
+    len = (size + page - 1) / page * page;
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (mode == PageMode::Huge2M) {
+      flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+    } else if (mode == PageMode::Huge1G) {
+      flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+    }
+    // Over-allocate THP buffers so they can start on a 2 MiB boundary
+    u64 extra = mode == PageMode::Transparent ? page : 0;
+    void *addr = mmap(nullptr, len + extra, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (addr == MAP_FAILED) {
+      perror("CSPM: [ERROR] mmap failed ");
+      if (flags & MAP_HUGETLB) {
+        printf("CSPM: [ERROR] Reserve huge pages first, e.g. in "
+               "/sys/kernel/mm/hugepages/hugepages-*/nr_hugepages\n");
+      }
+      exit(1);
+    }
+
+    base = (u8 *)addr;
+    if (extra) {
+      u8 *aligned = (u8 *)(((uintptr_t)base + page - 1) & ~(page - 1));
+      if (aligned > base) {
+        munmap(base, aligned - base);
+      }
+      if (aligned + len < base + len + extra) {
+        munmap(aligned + len, base + len + extra - (aligned + len));
+      }
+      base = aligned;
+    }
+
+    if (mode == PageMode::Transparent) {
+      madvise(base, len, MADV_HUGEPAGE);
+    } else if (mode == PageMode::Small) {
+      madvise(base, len, MADV_NOHUGEPAGE);
+    }
+  }
+
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+
+  ~Buffer() { munmap(base, len); }
+
+  // Fault every page in with one store per 4 KiB, so page faults and
+  // zeroing are paid here and not by the first measured iteration
+  auto touch() -> TouchCost {
+    struct rusage before, after;
+    getrusage(RUSAGE_THREAD, &before);
+    u64 start = monotonic_ns();
+    for (u64 off = 0; off < len; off += 4096) {
+      ((volatile u8 *)base)[off] = 0;
+    }
+    u64 end = monotonic_ns();
+    getrusage(RUSAGE_THREAD, &after);
+    return {len, end - start, (u64)(after.ru_minflt - before.ru_minflt)};
+  }
+
+  auto data() const -> u8 * { return base; }
+
+  auto size() const -> u64 { return len; }
+
+  auto page_size() const -> u64 {
+    switch (mode) {
+    case PageMode::Transparent:
+    case PageMode::Huge2M:
+      return 2 << 20;
+    case PageMode::Huge1G:
+      return 1 << 30;
+    default:
+      return 4096;
+    }
+  }
+
+private:
+  PageMode mode;
+  u8 *base = nullptr;
+  u64 len = 0;
+};
+
+inline auto print_touch(const char *what, const TouchCost &cost) -> void {
+  printf("First touch (%s): %lu bytes in %.3f ms, %lu faults (%.0f ns per "
+         "fault), %.2f GB/s\n",
+         what, cost.bytes, cost.ns / 1e6, cost.faults,
+         cost.faults ? (f64)cost.ns / cost.faults : 0.0,
+         cost.ns ? (f64)cost.bytes / cost.ns : 0.0);
+}
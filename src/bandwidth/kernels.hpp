@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cpuid.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <x86intrin.h>
+
+#include "utils.hpp"
+
+// Bandwidth kernels over f64 arrays with explicit vector loads and stores,
+// in the spirit of STREAM. Every ISA level gets its own set, compiled with a
+// target attribute, so one binary carries all of them and picks the widest
+// the CPU supports at runtime.
+//
+// The *_nt variants store with non-temporal (streaming) stores, which
+// bypass the caches and avoid reading the destination lines first.
+struct Kernels {
+  const char *name;
+  // Sum of a[0..n)
+  f64 (*read)(const f64 *a, u64 n);
+  // a[i] = s
+  void (*write)(f64 *a, f64 s, u64 n);
+  // a[i] = b[i]
+  void (*copy)(f64 *a, const f64 *b, u64 n);
+  // a[i] = s * b[i]
+  void (*scale)(f64 *a, const f64 *b, f64 s, u64 n);
+  // a[i] = b[i] + c[i]
+  void (*add)(f64 *a, const f64 *b, const f64 *c, u64 n);
+  // a[i] = b[i] + s * c[i]
+  void (*triad)(f64 *a, const f64 *b, const f64 *c, f64 s, u64 n);
+  void (*write_nt)(f64 *a, f64 s, u64 n);
+  void (*copy_nt)(f64 *a, const f64 *b, u64 n);
+  void (*scale_nt)(f64 *a, const f64 *b, f64 s, u64 n);
+  void (*add_nt)(f64 *a, const f64 *b, const f64 *c, u64 n);
+  void (*triad_nt)(f64 *a, const f64 *b, const f64 *c, f64 s, u64 n);
+};
+
+// Store loop shared by the write/copy/scale/add/triad kernels: `VEC` is the
+// vector for the elements from j on, `ONE` the value of element j alone.
+// Streaming stores need aligned addresses, so the head is peeled off first.
+#define CSPM_STORE_LOOP(W, STORE, VEC, ONE, ALIGN)                             \
+  u64 j = 0;                                                                   \
+  if (ALIGN) {                                                                 \
+    for (; j < n && ((uintptr_t)(a + j) & (W * sizeof(f64) - 1)); ++j) {       \
+      a[j] = ONE;                                                              \
+    }                                                                          \
+  }                                                                            \
+  for (; j + 4 * W <= n;) {                                                    \
+    STORE(a + j, VEC);                                                         \
+    j += W;                                                                    \
+    STORE(a + j, VEC);                                                         \
+    j += W;                                                                    \
+    STORE(a + j, VEC);                                                         \
+    j += W;                                                                    \
+    STORE(a + j, VEC);                                                         \
+    j += W;                                                                    \
+  }                                                                            \
+  for (; j < n; ++j) {                                                         \
+    a[j] = ONE;                                                                \
+  }                                                                            \
+  if (ALIGN) {                                                                 \
+    _mm_sfence();                                                              \
+  }
+
+// Both variants of a store kernel
+#define CSPM_STORE_KERNEL(W, STORE, STREAM, VEC, ONE)                          \
+  if (nt) {                                                                    \
+    CSPM_STORE_LOOP(W, STREAM, VEC, ONE, true)                                 \
+  } else {                                                                     \
+    CSPM_STORE_LOOP(W, STORE, VEC, ONE, false)                                 \
+  }
+
+// One set of kernels for vectors of W f64s of type T
+#define CSPM_DEFINE_KERNELS(ISA, TARGET, T, W, LOAD, STORE, STREAM, SET1, ADD, \
+                            MUL, ZERO)                                         \
+  namespace kernels_##ISA {                                                    \
+  __attribute__((target(TARGET))) inline auto read(const f64 *a, u64 n)        \
+      -> f64 {                                                                 \
+    /* Four accumulators hide the latency of the adds */                      \
+    T s0 = ZERO(), s1 = ZERO(), s2 = ZERO(), s3 = ZERO();                      \
+    u64 i = 0;                                                                 \
+    for (; i + 4 * W <= n; i += 4 * W) {                                       \
+      s0 = ADD(s0, LOAD(a + i));                                               \
+      s1 = ADD(s1, LOAD(a + i + W));                                           \
+      s2 = ADD(s2, LOAD(a + i + 2 * W));                                       \
+      s3 = ADD(s3, LOAD(a + i + 3 * W));                                       \
+    }                                                                          \
+    f64 lanes[W];                                                              \
+    STORE(lanes, ADD(ADD(s0, s1), ADD(s2, s3)));                               \
+    f64 sum = 0;                                                               \
+    for (u32 j = 0; j < W; ++j) {                                              \
+      sum += lanes[j];                                                         \
+    }                                                                          \
+    for (; i < n; ++i) {                                                       \
+      sum += a[i];                                                             \
+    }                                                                          \
+    return sum;                                                                \
+  }                                                                            \
+  __attribute__((target(TARGET))) inline auto write_impl(f64 *a, f64 s, u64 n, \
+                                                         bool nt) -> void {    \
+    T v = SET1(s);                                                             \
+    CSPM_STORE_KERNEL(W, STORE, STREAM, v, s)                                  \
+  }                                                                            \
+  __attribute__((target(TARGET))) inline auto copy_impl(                       \
+      f64 *a, const f64 *b, u64 n, bool nt) -> void {                          \
+    CSPM_STORE_KERNEL(W, STORE, STREAM, LOAD(b + j), b[j])                     \
+  }                                                                            \
+  __attribute__((target(TARGET))) inline auto scale_impl(                      \
+      f64 *a, const f64 *b, f64 s, u64 n, bool nt) -> void {                   \
+    T v = SET1(s);                                                             \
+    CSPM_STORE_KERNEL(W, STORE, STREAM, MUL(v, LOAD(b + j)), s * b[j])         \
+  }                                                                            \
+  __attribute__((target(TARGET))) inline auto add_impl(                        \
+      f64 *a, const f64 *b, const f64 *c, u64 n, bool nt) -> void {            \
+    CSPM_STORE_KERNEL(W, STORE, STREAM, ADD(LOAD(b + j), LOAD(c + j)),         \
+                      b[j] + c[j])                                             \
+  }                                                                            \
+  __attribute__((target(TARGET))) inline auto triad_impl(                      \
+      f64 *a, const f64 *b, const f64 *c, f64 s, u64 n, bool nt) -> void {     \
+    T v = SET1(s);                                                             \
+    CSPM_STORE_KERNEL(W, STORE, STREAM,                                        \
+                      ADD(LOAD(b + j), MUL(v, LOAD(c + j))),                   \
+                      b[j] + s * c[j])                                         \
+  }                                                                            \
+  inline auto write(f64 *a, f64 s, u64 n) -> void {                            \
+    write_impl(a, s, n, false);                                                \
+  }                                                                            \
+  inline auto copy(f64 *a, const f64 *b, u64 n) -> void {                      \
+    copy_impl(a, b, n, false);                                                 \
+  }                                                                            \
+  inline auto scale(f64 *a, const f64 *b, f64 s, u64 n) -> void {              \
+    scale_impl(a, b, s, n, false);                                             \
+  }                                                                            \
+  inline auto add(f64 *a, const f64 *b, const f64 *c, u64 n) -> void {         \
+    add_impl(a, b, c, n, false);                                               \
+  }                                                                            \
+  inline auto triad(f64 *a, const f64 *b, const f64 *c, f64 s, u64 n)          \
+      -> void {                                                                \
+    triad_impl(a, b, c, s, n, false);                                          \
+  }                                                                            \
+  inline auto write_nt(f64 *a, f64 s, u64 n) -> void {                         \
+    write_impl(a, s, n, true);                                                 \
+  }                                                                            \
+  inline auto copy_nt(f64 *a, const f64 *b, u64 n) -> void {                   \
+    copy_impl(a, b, n, true);                                                  \
+  }                                                                            \
+  inline auto scale_nt(f64 *a, const f64 *b, f64 s, u64 n) -> void {           \
+    scale_impl(a, b, s, n, true);                                              \
+  }                                                                            \
+  inline auto add_nt(f64 *a, const f64 *b, const f64 *c, u64 n) -> void {      \
+    add_impl(a, b, c, n, true);                                                \
+  }                                                                            \
+  inline auto triad_nt(f64 *a, const f64 *b, const f64 *c, f64 s, u64 n)       \
+      -> void {                                                                \
+    triad_impl(a, b, c, s, n, true);                                           \
+  }                                                                            \
+  inline const Kernels kernels = {#ISA, read,     write,    copy,              \
+                                  scale, add,     triad,    write_nt,          \
+                                  copy_nt, scale_nt, add_nt, triad_nt};        \
+  }
+
+CSPM_DEFINE_KERNELS(sse2, "sse2", __m128d, 2, _mm_loadu_pd, _mm_storeu_pd,
+                    _mm_stream_pd, _mm_set1_pd, _mm_add_pd, _mm_mul_pd,
+                    _mm_setzero_pd)
+CSPM_DEFINE_KERNELS(avx2, "avx2", __m256d, 4, _mm256_loadu_pd,
+                    _mm256_storeu_pd, _mm256_stream_pd, _mm256_set1_pd,
+                    _mm256_add_pd, _mm256_mul_pd, _mm256_setzero_pd)
+CSPM_DEFINE_KERNELS(avx512, "avx512f", __m512d, 8, _mm512_loadu_pd,
+                    _mm512_storeu_pd, _mm512_stream_pd, _mm512_set1_pd,
+                    _mm512_add_pd, _mm512_mul_pd, _mm512_setzero_pd)
+
+#undef CSPM_DEFINE_KERNELS
+#undef CSPM_STORE_KERNEL
+#undef CSPM_STORE_LOOP
+
+// Widest kernel set the CPU and the OS support, from CPUID and XCR0: the
+// OS has to save the AVX (and AVX-512) registers for them to be usable
+inline auto detect_kernels() -> const Kernels & {
+  u32 a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE)) {
+    return kernels_sse2::kernels;
+  }
+  u32 lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  u64 xcr0 = (u64)hi << 32 | lo;
+
+  if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+    return kernels_sse2::kernels;
+  }
+  // SSE, AVX, and the opmask and upper ZMM state
+  if ((b & bit_AVX512F) && (xcr0 & 0xe6) == 0xe6) {
+    return kernels_avx512::kernels;
+  }
+  if ((b & bit_AVX2) && (xcr0 & 0x6) == 0x6) {
+    return kernels_avx2::kernels;
+  }
+  return kernels_sse2::kernels;
+}
+
+// Kernel set by name ("auto", "sse2", "avx2", "avx512"), nullptr if unknown
+// or not supported by this CPU
+inline auto find_kernels(const std::string &name) -> const Kernels * {
+  const Kernels &best = detect_kernels();
+  if (name == "auto") {
+    return &best;
+  }
+  const Kernels *sets[] = {&kernels_sse2::kernels, &kernels_avx2::kernels,
+                           &kernels_avx512::kernels};
+  for (const Kernels *set : sets) {
+    if (name == set->name) {
+      return set;
+    }
+    if (set == &best) {
+      break;
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "measure.hpp"
+#include "utils.hpp"
+
+const u64 CACHE_LINE = 64;
+const u64 PAGE_SIZE = 4096;
+
+// Link `n` slots into one random cycle (Sattolo's algorithm), so every hop
+// is a dependent load the prefetchers cannot predict. `slot(i)` is the
+// address of slot i, which holds the address of the next one.
+template <typename F>
+inline auto link_cycle(u64 n, std::mt19937_64 &rng, F &&slot) -> void {
+  std::vector<u32> order(n);
+  for (u64 i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  for (u64 i = n - 1; i > 0; --i) {
+    std::uniform_int_distribution<u64> pick(0, i - 1);
+    std::swap(order[i], order[pick(rng)]);
+  }
+  for (u64 i = 0; i < n; ++i) {
+    *(void **)slot(i) = slot(order[i]);
+  }
+}
+
+// Follow the chain from `p` for `hops` loads, to where it ends up
+inline auto chase(void *p, u64 hops) -> void * {
+  for (u64 i = 0; i < hops; ++i) {
+    p = *(void **)p;
+  }
+  return p;
+}
+
+// Latency of a working set of `size` bytes in `buf`, one slot per cache
+// line. With `per_page` there is one slot per 4 KiB page instead, at a
+// different line of every page, so the data stays small and the steps of
+// the curve come from the TLBs. Every sample of `config` follows the chain
+// for `hops / reps` loads; the median is returned in ns per load.
+inline auto measure_latency(u8 *buf, u64 size, bool per_page, u64 hops,
+                            std::mt19937_64 &rng, MeasureConfig config)
+    -> f64 {
+  u64 stride = per_page ? PAGE_SIZE : CACHE_LINE;
+  u64 n = size / stride;
+  if (n < 2) {
+    return 0;
+  }
+  auto slot = [&](u64 i) -> void * {
+    u64 offset = per_page ? (i % (PAGE_SIZE / CACHE_LINE)) * CACHE_LINE : 0;
+    return buf + i * stride + offset;
+  };
+  link_cycle(n, rng, slot);
+  // One pass to warm the caches and TLBs
+  void *p = chase(slot(0), n < hops ? n : hops);
+  u64 chunk = hops / config.reps ? hops / config.reps : 1;
+  config.batch = 1;
+  Stats stats = measure([&]() { p = chase(p, chunk); }, config);
+  // Keep the chain alive
+  __asm__ volatile("" : : "r"(p));
+  return stats.median / chunk;
+}
+
+struct LatencyPoint {
+  u64 size;
+  f64 ns;
+};
+
+// Sizes where the latency curve steps up: the last size of every plateau
+// that the curve later leaves by more than `rise` (relative); the levels of
+// a hierarchy differ by far more than the creep within one. The next
+// plateau starts where consecutive points differ by less than 5% again.
+inline auto find_steps(const std::vector<LatencyPoint> &points,
+                       f64 rise = 0.5) -> std::vector<u64> {
+  std::vector<u64> steps;
+  if (points.empty()) {
+    return steps;
+  }
+  f64 level = points[0].ns;
+  u64 last = points[0].size;
+  for (size_t i = 1; i < points.size(); ++i) {
+    if (points[i].ns <= level * (1 + rise)) {
+      last = points[i].size;
+      continue;
+    }
+    steps.push_back(last);
+    while (i + 1 < points.size() && points[i + 1].ns > points[i].ns * 1.05) {
+      ++i;
+    }
+    level = points[i].ns;
+    last = points[i].size;
+  }
+  return steps;
+}
+
+// One cache as described in /sys/devices/system/cpu/cpu0/cache
+struct CacheInfo {
+  u32 level;
+  std::string type;
+  u64 size;
+};
+
+inline auto read_sys_caches() -> std::vector<CacheInfo> {
+  std::vector<CacheInfo> caches;
+  for (u32 index = 0;; ++index) {
+    char path[128];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%u/level", index);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+      break;
+    }
+    CacheInfo info = {0, "", 0};
+    if (fscanf(fp, "%u", &info.level) != 1) {
+      info.level = 0;
+    }
+    fclose(fp);
+
+    char buf[64];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%u/type", index);
+    fp = fopen(path, "r");
+    if (fp) {
+      if (fscanf(fp, "%63s", buf) == 1) {
+        info.type = buf;
+      }
+      fclose(fp);
+    }
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu0/cache/index%u/size", index);
+    fp = fopen(path, "r");
+    if (fp) {
+      u64 size;
+      char unit = 0;
+      if (fscanf(fp, "%lu%c", &size, &unit) >= 1) {
+        info.size = size * (unit == 'K' ? 1 << 10 : unit == 'M' ? 1 << 20 : 1);
+      }
+      fclose(fp);
+    }
+    caches.push_back(info);
+  }
+  return caches;
+}
+
+// Cache sizes next to the results, for plotting: "source,level,type,size"
+// rows from /sys ("sys") and, if measured, from the latency curves
+// ("latency" for the caches, "tlb" for the TLB reach)
+inline auto write_caches(const std::string &path,
+                         const std::vector<u64> &latency_steps,
+                         const std::vector<u64> &tlb_steps) -> void {
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    perror("CSPM: [ERROR] Cannot open cache file ");
+    return;
+  }
+  fprintf(fp, "source,level,type,size\n");
+  for (const CacheInfo &cache : read_sys_caches()) {
+    fprintf(fp, "sys,%u,%s,%lu\n", cache.level, cache.type.c_str(),
+            cache.size);
+  }
+  for (size_t i = 0; i < latency_steps.size(); ++i) {
+    fprintf(fp, "latency,%lu,,%lu\n", i + 1, latency_steps[i]);
+  }
+  for (size_t i = 0; i < tlb_steps.size(); ++i) {
+    fprintf(fp, "tlb,%lu,,%lu\n", i + 1, tlb_steps[i]);
+  }
+  fclose(fp);
+}
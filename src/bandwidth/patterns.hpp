@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+// Memory the patterns run over. `index` holds random u32s, scaled to the
+// working set with a multiply-shift, so the random patterns read their
+// addresses from a precomputed array instead of computing them.
+struct PatternArgs {
+  u64 *data;
+  u64 *temp;
+  const u32 *index;
+  u64 index_len;
+  // Keeps the loaded values alive
+  u64 sum;
+};
+
+// An access pattern: one pass over a working set of `n` words returns how
+// many words it accessed
+struct Pattern {
+  std::string name;
+  std::function<u64(PatternArgs &, u64 n)> pass;
+};
+
+const u64 INDEX_LEN = 1 << 22;
+
+inline auto make_index(u64 len, std::mt19937_64 &rng) -> std::vector<u32> {
+  std::vector<u32> index(len);
+  for (u32 &i : index) {
+    i = (u32)rng();
+  }
+  return index;
+}
+
+inline auto scale_index(u32 r, u64 n) -> u64 { return (u64)r * n >> 32; }
+
+// One word every `stride` bytes
+inline auto stride_pattern(u64 stride) -> Pattern {
+  u64 s = stride / sizeof(u64);
+  return {"stride_" + std::to_string(stride), [s](PatternArgs &args, u64 n) {
+            u64 sum = 0;
+            for (u64 i = 0; i < n; i += s) {
+              sum += args.data[i];
+            }
+            args.sum += sum;
+            return (n + s - 1) / s;
+          }};
+}
+
+// Up to INDEX_LEN random accesses: loads, stores, or increments
+inline auto random_pattern(const std::string &name, bool read, bool write)
+    -> Pattern {
+  return {name, [read, write](PatternArgs &args, u64 n) {
+            u64 len = n < args.index_len ? n : args.index_len;
+            u64 sum = 0;
+            for (u64 j = 0; j < len; ++j) {
+              u64 i = scale_index(args.index[j], n);
+              if (read && write) {
+                args.data[i] += 1;
+              } else if (read) {
+                sum += args.data[i];
+              } else {
+                args.data[i] = j;
+              }
+            }
+            args.sum += sum;
+            return len;
+          }};
+}
+
+// In-place sequential update
+inline auto rmw_pattern() -> Pattern {
+  return {"rmw", [](PatternArgs &args, u64 n) {
+            for (u64 i = 0; i < n; ++i) {
+              args.data[i] += 1;
+            }
+            return n;
+          }};
+}
+
+// Sequential, `reads` words loaded from data for every `writes` words
+// stored to temp, `n` words over both. A last partial step covers what is
+// left of `n`, so every pass touches all `n` words even when they are fewer
+// than one step.
+inline auto mix_pattern(u32 reads, u32 writes) -> Pattern {
+  return {"mix_" + std::to_string(reads) + "_" + std::to_string(writes),
+          [reads, writes](PatternArgs &args, u64 n) {
+            u64 steps = n / (reads + writes);
+            const u64 *src = args.data;
+            u64 *dst = args.temp;
+            u64 sum = 0;
+            for (u64 step = 0; step < steps; ++step) {
+              for (u32 r = 0; r < reads; ++r) {
+                sum += *src++;
+              }
+              for (u32 w = 0; w < writes; ++w) {
+                *dst++ = sum;
+              }
+            }
+            u64 left = n - steps * (reads + writes);
+            u64 tail_reads = left < reads ? left : reads;
+            for (u64 r = 0; r < tail_reads; ++r) {
+              sum += *src++;
+            }
+            for (u64 w = tail_reads; w < left; ++w) {
+              *dst++ = sum;
+            }
+            args.sum += sum;
+            return n;
+          }};
+}
+
+// Patterns from a comma-separated list of
+//   stride        strides of 8 B to 4 KiB, doubling
+//   strideB       a stride of B bytes, a multiple of 8
+//   random        random reads and writes
+//   rmw           sequential and random read-modify-write
+//   mix           read:write mixes of 1:1, 2:1, 3:1 and 1:2
+//   mixN:M        N reads for every M writes
+inline auto parse_patterns(const std::string &list,
+                           std::vector<Pattern> &patterns) -> bool {
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string item = list.substr(pos, end - pos);
+    pos = end + 1;
+
+    u64 stride;
+    u32 reads, writes;
+    char rest;
+    if (item == "stride") {
+      for (u64 s = 8; s <= 4096; s *= 2) {
+        patterns.push_back(stride_pattern(s));
+      }
+    } else if (sscanf(item.c_str(), "stride%lu%c", &stride, &rest) == 1) {
+      if (stride == 0 || stride % sizeof(u64)) {
+        return false;
+      }
+      patterns.push_back(stride_pattern(stride));
+    } else if (item == "random") {
+      patterns.push_back(random_pattern("random_read", true, false));
+      patterns.push_back(random_pattern("random_write", false, true));
+    } else if (item == "rmw") {
+      patterns.push_back(rmw_pattern());
+      patterns.push_back(random_pattern("random_rmw", true, true));
+    } else if (item == "mix") {
+      patterns.push_back(mix_pattern(1, 1));
+      patterns.push_back(mix_pattern(2, 1));
+      patterns.push_back(mix_pattern(3, 1));
+      patterns.push_back(mix_pattern(1, 2));
+    } else if (sscanf(item.c_str(), "mix%u:%u%c", &reads, &writes, &rest) ==
+               2) {
+      if (reads == 0 && writes == 0) {
+        return false;
+      }
+      patterns.push_back(mix_pattern(reads, writes));
+    } else {
+      return false;
+    }
+  }
+  return !patterns.empty();
+}
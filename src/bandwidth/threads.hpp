@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+#include <x86intrin.h>
+
+#include "utils.hpp"
+
+// Sense-reversing spin barrier. Waiters leave within a few hundred
+// nanoseconds of each other, where a futex based barrier would stagger the
+// start of the measured loops by the wake-up latency.
+class SpinBarrier {
+public:
+  explicit SpinBarrier(u32 n) : n(n) {}
+
+  auto wait() -> void {
+    u32 gen = generation.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == n) {
+      arrived.store(0, std::memory_order_relaxed);
+      generation.fetch_add(1, std::memory_order_release);
+      return;
+    }
+    for (u32 spins = 0; generation.load(std::memory_order_acquire) == gen;
+         ++spins) {
+      _mm_pause();
+      // Oversubscribed: let the thread we wait for run
+      if (spins % 1024 == 1023) {
+        sched_yield();
+      }
+    }
+  }
+
+private:
+  u32 n;
+  std::atomic<u32> arrived{0};
+  std::atomic<u32> generation{0};
+};
+
+// Pin the calling thread to `cpu`
+inline auto pin_to_cpu(int cpu) -> bool {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// CPUs this process may run on, in order
+inline auto allowed_cpus() -> std::vector<int> {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+// NUMA node of `cpu` from the nodeN link in its /sys directory, 0 on
+// machines without NUMA information
+inline auto cpu_node(int cpu) -> int {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return 0;
+  }
+  int node = 0;
+  while (struct dirent *entry = readdir(dir)) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// Where a CPU sits: its package (socket) and its physical core, which SMT
+// siblings share
+struct CpuTopology {
+  int package;
+  int core;
+};
+
+inline auto cpu_topology(int cpu) -> CpuTopology {
+  CpuTopology topology = {0, cpu};
+  const char *files[] = {"physical_package_id", "core_id"};
+  int *fields[] = {&topology.package, &topology.core};
+  for (int i = 0; i < 2; ++i) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+             cpu, files[i]);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+      continue;
+    }
+    if (fscanf(fp, "%d", fields[i]) != 1) {
+      *fields[i] = i == 0 ? 0 : cpu;
+    }
+    fclose(fp);
+  }
+  return topology;
+}
+
+// Parse a CPU list such as "0-3,8,10-11". Ranges run upwards and CPUs are
+// below CPU_SETSIZE, so every one can be pinned to.
+inline auto parse_cpu_list(const std::string &list, std::vector<int> &cpus)
+    -> bool {
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    int first, last;
+    std::string item = list.substr(pos, end - pos);
+    int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+    if (n == 1) {
+      last = first;
+    }
+    if (n < 1 || first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    pos = end + 1;
+  }
+  return !cpus.empty();
+}
@@ -0,0 +1,297 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cxxopts.hpp>
+
+#include "bandwidth/threads.hpp"
+#include "timeit.hpp"
+#include "utils.hpp"
+
+// Core-to-core latency: pairs of pinned threads bounce a cache line between
+// their cores, so every round trip pays two transfers of the line.
+
+// Everything one pair shares, every field on its own cache line
+struct alignas(64) PairSlot {
+  // Ping-pong: odd values from the initiator, even ones from the responder
+  alignas(64) std::atomic<u64> ball{0};
+  // False sharing: both counters on one line...
+  alignas(64) std::atomic<u64> shared[2]{};
+  // ...and each on its own
+  alignas(64) std::atomic<u64> padded[2]{};
+  alignas(64) SpinBarrier start{2};
+  alignas(64) f64 times[2];
+};
+
+// Spin until `line` holds `value`. No pause: it would add its own latency
+// to every hop.
+inline auto wait_for(const std::atomic<u64> &line, u64 value) -> void {
+  for (u32 spins = 1; line.load(std::memory_order_acquire) != value; ++spins) {
+    // Oversubscribed: let the partner run
+    if (spins % (1 << 16) == 0) {
+      sched_yield();
+    }
+  }
+}
+
+// ns per round trip, best of five batches of `rounds`; the first batch
+// also warms up the line
+inline auto ping_pong(PairSlot &slot, bool initiator, u64 rounds) -> f64 {
+  f64 best = 0;
+  for (u32 batch = 0; batch < 5; ++batch) {
+    if (initiator) {
+      slot.ball.store(0, std::memory_order_relaxed);
+    }
+    slot.start.wait();
+    if (!initiator) {
+      for (u64 r = 0; r < rounds; ++r) {
+        wait_for(slot.ball, 2 * r + 1);
+        slot.ball.store(2 * r + 2, std::memory_order_release);
+      }
+      continue;
+    }
+    u64 begin = monotonic_ns();
+    for (u64 r = 0; r < rounds; ++r) {
+      slot.ball.store(2 * r + 1, std::memory_order_release);
+      wait_for(slot.ball, 2 * r + 2);
+    }
+    f64 ns = (f64)(monotonic_ns() - begin) / rounds;
+    best = batch == 0 || ns < best ? ns : best;
+  }
+  return best;
+}
+
+// ns per increment while both threads increment their own counter, the
+// slower of the two
+inline auto increment(PairSlot &slot, bool initiator, u64 iterations,
+                      bool padded) -> f64 {
+  u32 self = initiator ? 0 : 1;
+  std::atomic<u64> &counter = padded ? slot.padded[self] : slot.shared[self];
+  slot.start.wait();
+  u64 begin = monotonic_ns();
+  for (u64 i = 0; i < iterations; ++i) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+  slot.times[self] = (f64)(monotonic_ns() - begin) / iterations;
+  slot.start.wait();
+  return slot.times[0] > slot.times[1] ? slot.times[0] : slot.times[1];
+}
+
+typedef std::vector<std::pair<u32, u32>> Step;
+
+// All pairs of `n` threads, round-robin (circle method): n - 1 steps for
+// even n, in which no thread is in two pairs, so the pairs of a step can
+// run at the same time. With `serial` every pair is a step of its own.
+inline auto schedule(u32 n, bool serial) -> std::vector<Step> {
+  std::vector<Step> steps;
+  // A bye for odd n
+  u32 m = n + (n & 1);
+  for (u32 r = 0; r + 1 < m; ++r) {
+    Step step;
+    auto add = [&](u32 a, u32 b) {
+      if (a < n && b < n) {
+        step.push_back({a < b ? a : b, a < b ? b : a});
+      }
+    };
+    add(r, m - 1);
+    for (u32 i = 1; i < m / 2; ++i) {
+      add((r + i) % (m - 1), (r + m - 1 - i) % (m - 1));
+    }
+    if (serial) {
+      for (auto &pair : step) {
+        steps.push_back({pair});
+      }
+    } else if (!step.empty()) {
+      steps.push_back(step);
+    }
+  }
+  return steps;
+}
+
+struct PairResult {
+  f64 round_trip;
+  f64 shared;
+  f64 padded;
+};
+
+// c2c.csv -> c2c.false_sharing.csv
+inline auto false_sharing_path_of(const std::string &output) -> std::string {
+  std::string base = output;
+  if (base.size() > 4 && base.compare(base.size() - 4, 4, ".csv") == 0) {
+    base.resize(base.size() - 4);
+  }
+  return base + ".false_sharing.csv";
+}
+
+auto main(int argc, char **argv) -> int {
+  cxxopts::Options options(
+      "c2c", "Test cache-line transfer latency between every pair of cores");
+
+  std::string output_file;
+  std::string cores;
+  u64 rounds;
+  u64 iterations;
+  bool serial;
+
+  // clang-format off
+    options.add_options()
+      ("h,help", "Print help")
+      ("o,output", "Output file for the round-trip matrix, the false sharing results go to <output>.false_sharing.csv",
+      cxxopts::value(output_file)->default_value("c2c.csv"))
+      ("c,cores", "CPUs to test, e.g. 0-3,8 (default: all allowed CPUs)",
+      cxxopts::value(cores)->default_value(""))
+      ("r,rounds", "Round trips per batch (default: 10000)",
+      cxxopts::value(rounds)->default_value("10000"))
+      ("i,iterations", "Increments per thread in the false sharing test (default: 100000)",
+      cxxopts::value(iterations)->default_value("100000"))
+      ("serial", "Test one pair at a time instead of all disjoint pairs at once",
+      cxxopts::value(serial)->default_value("false"))
+    ;
+  // clang-format on
+
+  auto result = options.parse(argc, argv);
+
+  if (result["help"].as<bool>()) {
+    printf("%s\n", options.help().c_str());
+    return 0;
+  }
+
+  std::vector<int> cpus;
+  if (cores.empty()) {
+    cpus = allowed_cpus();
+  } else if (!parse_cpu_list(cores, cpus)) {
+    printf("CSPM: [ERROR] Invalid CPU list: %s\n", cores.c_str());
+    return 1;
+  }
+  if (cpus.size() < 2) {
+    printf("CSPM: [ERROR] Need at least 2 CPUs, got %lu\n", cpus.size());
+    return 1;
+  }
+  if (rounds == 0 || iterations == 0) {
+    printf("CSPM: [ERROR] --rounds and --iterations must be positive\n");
+    return 1;
+  }
+
+  FILE *fp = fopen(output_file.c_str(), "w");
+  if (!fp) {
+    perror("CSPM: [ERROR] Cannot open output file ");
+    return 1;
+  }
+  std::string fs_path = false_sharing_path_of(output_file);
+  FILE *fs = fopen(fs_path.c_str(), "w");
+  if (!fs) {
+    perror("CSPM: [ERROR] Cannot open false sharing file ");
+    return 1;
+  }
+
+  u32 n = cpus.size();
+  std::vector<Step> steps = schedule(n, serial);
+  std::unique_ptr<PairSlot[]> slots(new PairSlot[n / 2]);
+  std::vector<std::vector<PairResult>> results(
+      n, std::vector<PairResult>(n, {0, 0, 0}));
+  SpinBarrier barrier(n);
+
+  auto worker = [&](u32 id) {
+    if (!pin_to_cpu(cpus[id])) {
+      printf("CSPM: [ERROR] Cannot pin thread %u to CPU %d\n", id, cpus[id]);
+    }
+    for (const Step &step : steps) {
+      barrier.wait();
+      for (u32 i = 0; i < step.size(); ++i) {
+        auto [a, b] = step[i];
+        if (id != a && id != b) {
+          continue;
+        }
+        bool initiator = id == a;
+        PairSlot &slot = slots[i];
+        f64 round_trip = ping_pong(slot, initiator, rounds);
+        f64 shared = increment(slot, initiator, iterations, false);
+        f64 padded = increment(slot, initiator, iterations, true);
+        if (initiator) {
+          results[a][b] = results[b][a] = {round_trip, shared, padded};
+        }
+      }
+      // Thread 0 reports while the others wait at the next step
+      barrier.wait();
+      if (id == 0) {
+        for (auto [a, b] : step) {
+          const PairResult &r = results[a][b];
+          printf("CPU %d <-> CPU %d: %.1f ns round trip, %.1f ns false "
+                 "sharing, %.1f ns padded\n",
+                 cpus[a], cpus[b], r.round_trip, r.shared, r.padded);
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (u32 i = 1; i < n; ++i) {
+    threads.emplace_back(worker, i);
+  }
+  worker(0);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  // Round-trip matrix, empty on the diagonal
+  fprintf(fp, "cpu");
+  for (int cpu : cpus) {
+    fprintf(fp, ",%d", cpu);
+  }
+  fprintf(fp, "\n");
+  for (u32 a = 0; a < n; ++a) {
+    fprintf(fp, "%d", cpus[a]);
+    for (u32 b = 0; b < n; ++b) {
+      if (a == b) {
+        fprintf(fp, ",");
+      } else {
+        fprintf(fp, ",%.2f", results[a][b].round_trip);
+      }
+    }
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+
+  fprintf(fs, "cpu_a,cpu_b,shared_ns,padded_ns\n");
+  for (u32 a = 0; a < n; ++a) {
+    for (u32 b = a + 1; b < n; ++b) {
+      fprintf(fs, "%d,%d,%.2f,%.2f\n", cpus[a], cpus[b], results[a][b].shared,
+              results[a][b].padded);
+    }
+  }
+  fclose(fs);
+
+  // Summary by how far apart the two CPUs are
+  const char *classes[] = {"SMT siblings", "Same package", "Cross package"};
+  f64 sum[3] = {0, 0, 0}, lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+  u64 count[3] = {0, 0, 0};
+  std::vector<CpuTopology> topology;
+  for (int cpu : cpus) {
+    topology.push_back(cpu_topology(cpu));
+  }
+  for (u32 a = 0; a < n; ++a) {
+    for (u32 b = a + 1; b < n; ++b) {
+      u32 c = topology[a].package != topology[b].package ? 2
+              : topology[a].core != topology[b].core     ? 1
+                                                         : 0;
+      f64 ns = results[a][b].round_trip;
+      lo[c] = count[c] == 0 || ns < lo[c] ? ns : lo[c];
+      hi[c] = count[c] == 0 || ns > hi[c] ? ns : hi[c];
+      sum[c] += ns;
+      ++count[c];
+    }
+  }
+  printf("===== Round trip =====\n");
+  for (u32 c = 0; c < 3; ++c) {
+    if (count[c]) {
+      printf("%s: %.1f ns mean, %.1f - %.1f ns (%lu pairs)\n", classes[c],
+             sum[c] / count[c], lo[c], hi[c], count[c]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+import argparse
+
+import polars as pl
+import matplotlib.pyplot as plt
+
+parser = argparse.ArgumentParser()
+
+parser.add_argument(
+    "input_file",
+    help="Path to the input file",
+    default="c2c.csv",
+    type=str,
+)
+parser.add_argument(
+    "output_file",
+    help="Path to the output file",
+    default="c2c.png",
+    type=str,
+)
+
+args = parser.parse_args()
+
+# Read the CSV file
+#
+# cpu, <cpu>...: round trip (ns) between the CPU of the row and of the column
+data = pl.read_csv(args.input_file)
+cpus = data["cpu"].to_list()
+matrix = data.drop("cpu").to_numpy()
+
+fig, ax = plt.subplots(figsize=(8, 7))
+image = ax.imshow(matrix, cmap="viridis")
+fig.colorbar(image, ax=ax, label="Round trip (ns)")
+
+# Label every CPU on small machines, every 8th on large ones
+step = 1 if len(cpus) <= 32 else 8
+ax.set_xticks(range(0, len(cpus), step), cpus[::step])
+ax.set_yticks(range(0, len(cpus), step), cpus[::step])
+ax.set_xlabel("CPU")
+ax.set_ylabel("CPU")
+ax.set_title("Core-to-core latency")
+plt.savefig(args.output_file)
@@ -1,33 +1,1127 @@
 #define _GNU_SOURCE
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "io.h"
+
 struct io_config {
   int output_fd;
+  int trace_fd;
   double size_fractor;
   double time_fractor;
+  // Summary snapshots while running, 0 for only at exit
+  uint64_t snapshot_ns;
 };
 
-struct io_config config;
+struct io_config config = {-1, -1, 1, 1, 0};
 
 ssize_t (*system_read)(int fd, void *buf, size_t count) = NULL;
 ssize_t (*system_write)(int fd, const void *buf, size_t count) = NULL;
+ssize_t (*system_pread)(int fd, void *buf, size_t count, off_t offset) = NULL;
+ssize_t (*system_pwrite)(int fd, const void *buf, size_t count,
+                         off_t offset) = NULL;
+ssize_t (*system_readv)(int fd, const struct iovec *iov, int iovcnt) = NULL;
+ssize_t (*system_writev)(int fd, const struct iovec *iov, int iovcnt) = NULL;
+ssize_t (*system_preadv)(int fd, const struct iovec *iov, int iovcnt,
+                         off_t offset) = NULL;
+ssize_t (*system_pwritev)(int fd, const struct iovec *iov, int iovcnt,
+                          off_t offset) = NULL;
+ssize_t (*system_preadv2)(int fd, const struct iovec *iov, int iovcnt,
+                          off_t offset, int flags) = NULL;
+ssize_t (*system_pwritev2)(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, int flags) = NULL;
+int (*system_fsync)(int fd) = NULL;
+int (*system_fdatasync)(int fd) = NULL;
+ssize_t (*system_sendfile)(int out_fd, int in_fd, off_t *offset,
+                           size_t count) = NULL;
+ssize_t (*system_copy_file_range)(int fd_in, off_t *off_in, int fd_out,
+                                  off_t *off_out, size_t len,
+                                  unsigned int flags) = NULL;
+void *(*system_mmap)(void *addr, size_t length, int prot, int flags, int fd,
+                     off_t offset) = NULL;
+int (*system_open)(const char *path, int flags, ...) = NULL;
+int (*system_openat)(int dirfd, const char *path, int flags, ...) = NULL;
+int (*system_close)(int fd) = NULL;
+off_t (*system_lseek)(int fd, off_t offset, int whence) = NULL;
+FILE *(*system_fopen)(const char *path, const char *mode) = NULL;
+FILE *(*system_freopen)(const char *path, const char *mode,
+                        FILE *stream) = NULL;
+FILE *(*system_fdopen)(int fd, const char *mode) = NULL;
+int (*system_fclose)(FILE *stream) = NULL;
+
+// Log-linear histogram, HDR style: eight buckets per power of two, so
+// percentiles are within 12.5%
+#define IO_HIST_SUB 8
+#define IO_HIST_BUCKETS (64 * IO_HIST_SUB)
+
+struct io_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[IO_HIST_BUCKETS];
+};
+
+struct io_op_stats {
+  // ns
+  struct io_hist latency;
+  // Requested bytes
+  struct io_hist size;
+};
+
+// Access pattern of reads or writes of one open file, shared by all
+// threads: each access continues the last one (sequential), repeats the
+// last distance (strided) or not (random)
+struct io_pattern {
+  // Every pattern, newest first
+  struct io_pattern *link;
+  int fd;
+  uint32_t generation;
+  int dir;
+  char *path;
+  // Only used under the lock of the fd
+  int64_t next;
+  int64_t last;
+  int64_t stride;
+  // Read by merges
+  uint64_t sequential;
+  uint64_t strided;
+  uint64_t random;
+  // Bytes of the current run of sequential accesses
+  uint64_t run;
+  // Bytes of finished runs
+  struct io_hist runs;
+  // Accesses of pipes, sockets and ttys, which have no offsets
+  uint64_t unseekable;
+};
+
+#define IO_DIR_READ 0
+#define IO_DIR_WRITE 1
+
+// Stats of one open file in one thread, or merged over threads. Ops and
+// patterns are allocated on first use.
+struct io_fd_stats {
+  struct io_fd_stats *next;
+  uint32_t generation;
+  int fd;
+  char *path;
+  // Passes the path and fd filters
+  int traced;
+  struct io_op_stats *ops[IO_OP_COUNT];
+  // Merged access patterns, in summaries only
+  struct io_pattern *patterns[2];
+};
+
+// fds from IO_MAX_FDS up (and invalid ones) share the last slot
+#define IO_MAX_FDS 1024
+
+// Bumped by open and close, so a reused fd starts new stats with its own
+// path
+static uint32_t fd_generation[IO_MAX_FDS + 1];
+
+// File position of each fd, advanced by the calls without an offset. Valid
+// while `known` is the fd generation plus one, so fds never seen (stdio,
+// inherited, pipes) start unknown; -1 for pipes and sockets.
+struct io_position {
+  uint32_t known;
+  int64_t offset;
+};
+
+static struct io_position fd_position[IO_MAX_FDS];
+
+// Current pattern of each fd and direction, and a spinlock per fd
+static struct io_pattern *fd_patterns[IO_MAX_FDS][2];
+static unsigned char fd_pattern_lock[IO_MAX_FDS];
+
+// Offset argument of the calls that use (and move) the file position
+#define IO_AT_POSITION -2
+// Offset of calls on pipes, sockets and ttys
+#define IO_NOT_SEEKABLE -3
+
+#define IO_MAX_PREFIXES 8
+
+// Which calls go into the trace. The summary counts every call.
+struct io_filter {
+  // Any of these path prefixes, if given, made absolute (see
+  // absolute_prefix) to compare with the paths of /proc/self/fd
+  const char *prefixes[IO_MAX_PREFIXES];
+  int prefix_count;
+  // Any of these fds, if given
+  int by_fd;
+  unsigned char fds[IO_MAX_FDS];
+  // Calls at least this slow
+  uint64_t min_ns;
+  // Then every n-th of them, per thread
+  uint64_t sample;
+};
+
+static struct io_filter filter = {.sample = 1};
+
+// Events are appended to a buffer of the calling thread without locks or
+// syscalls. Full buffers go to a queue that a flusher thread writes to the
+// trace file in large writes, and come back empty.
+#define IO_BUFFER_EVENTS 2048
+
+struct io_buffer {
+  struct io_buffer *next;
+  size_t used;
+  struct io_event events[IO_BUFFER_EVENTS];
+};
+
+// Per-thread state. The stats are a shard only this thread writes, merged
+// with the other shards at exit or for a snapshot.
+struct io_thread {
+  struct io_thread *next;
+  struct io_buffer *current;
+  uint32_t tid;
+  // Every entry of the shard, newest first
+  struct io_fd_stats *stats;
+  // Calls that passed the latency filter, for sampling
+  uint64_t matched;
+  // Calls written to the trace
+  uint64_t recorded;
+  // Current entry of each fd
+  struct io_fd_stats *by_fd[IO_MAX_FDS + 1];
+};
+
+static __thread struct io_thread *thread_state = NULL;
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+// FIFO of full buffers
+static struct io_buffer *flush_head = NULL;
+static struct io_buffer *flush_tail = NULL;
+static struct io_buffer *free_buffers = NULL;
+// Every thread that recorded, for the final flush
+static struct io_thread *threads = NULL;
+static pthread_key_t thread_key;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flush_stop = 0;
+// Set at unload: buffers are not taken or queued any more
+static int trace_closed = 0;
+// Set in a forked child, whose summary covers only its own calls
+static int forked = 0;
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// A shard has a single writer: relaxed stores and loads let snapshots read
+// it while it runs, at the cost of plain moves
+static inline void add_relaxed(uint64_t *p, uint64_t v) {
+  __atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t load_relaxed(const uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline unsigned hist_bucket(uint64_t v) {
+  if (v < IO_HIST_SUB) {
+    return v;
+  }
+  unsigned msb = 63 - __builtin_clzll(v);
+  return (msb - 2) * IO_HIST_SUB + ((v >> (msb - 3)) & (IO_HIST_SUB - 1));
+}
+
+// Largest value of a bucket
+static uint64_t hist_limit(unsigned bucket) {
+  if (bucket < IO_HIST_SUB) {
+    return bucket;
+  }
+  unsigned msb = bucket / IO_HIST_SUB + 2;
+  uint64_t sub = bucket % IO_HIST_SUB;
+  return ((IO_HIST_SUB + sub + 1) << (msb - 3)) - 1;
+}
+
+static inline void hist_add(struct io_hist *h, uint64_t v) {
+  add_relaxed(&h->count, 1);
+  add_relaxed(&h->sum, v);
+  if (v > h->max) {
+    __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+  }
+  add_relaxed(&h->buckets[hist_bucket(v)], 1);
+}
+
+static void hist_merge(struct io_hist *dst, const struct io_hist *src) {
+  dst->count += load_relaxed(&src->count);
+  dst->sum += load_relaxed(&src->sum);
+  uint64_t max = load_relaxed(&src->max);
+  dst->max = max > dst->max ? max : dst->max;
+  for (unsigned i = 0; i < IO_HIST_BUCKETS; ++i) {
+    dst->buckets[i] += load_relaxed(&src->buckets[i]);
+  }
+}
+
+static uint64_t hist_percentile(const struct io_hist *h, double p) {
+  uint64_t rank = (uint64_t)(p * h->count);
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < IO_HIST_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      uint64_t limit = hist_limit(i);
+      return limit < h->max ? limit : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void merge_pattern(struct io_pattern *dst, const struct io_pattern *src) {
+  dst->sequential += load_relaxed(&src->sequential);
+  dst->strided += load_relaxed(&src->strided);
+  dst->random += load_relaxed(&src->random);
+  dst->unseekable += load_relaxed(&src->unseekable);
+  hist_merge(&dst->runs, &src->runs);
+  // The open run counts as finished
+  uint64_t run = load_relaxed(&src->run);
+  if (run) {
+    dst->runs.count += 1;
+    dst->runs.sum += run;
+    dst->runs.max = run > dst->runs.max ? run : dst->runs.max;
+    dst->runs.buckets[hist_bucket(run)] += 1;
+  }
+}
+
+static void merge_stats(struct io_fd_stats *dst,
+                        const struct io_fd_stats *src) {
+  for (int op = 0; op < IO_OP_COUNT; ++op) {
+    const struct io_op_stats *ops =
+        __atomic_load_n(&src->ops[op], __ATOMIC_ACQUIRE);
+    if (!ops) {
+      continue;
+    }
+    if (!dst->ops[op] &&
+        !(dst->ops[op] = calloc(1, sizeof(struct io_op_stats)))) {
+      continue;
+    }
+    hist_merge(&dst->ops[op]->latency, &ops->latency);
+    hist_merge(&dst->ops[op]->size, &ops->size);
+  }
+}
+
+// What `fd` refers to, from /proc/self/fd
+static char *fd_path(int fd) {
+  if (fd < 0) {
+    return strdup("(other fds)");
+  }
+  char link[64], path[4096];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, path, sizeof(path) - 1);
+  if (n < 0) {
+    return strdup("?");
+  }
+  path[n] = 0;
+  return strdup(path);
+}
+
+static inline int fd_slot(int fd) {
+  return fd >= 0 && fd < IO_MAX_FDS ? fd : IO_MAX_FDS;
+}
+
+static int file_traced(int fd, const char *path) {
+  if (filter.by_fd && (fd < 0 || !filter.fds[fd])) {
+    return 0;
+  }
+  if (!filter.prefix_count) {
+    return 1;
+  }
+  for (int i = 0; i < filter.prefix_count; ++i) {
+    if (strncmp(path, filter.prefixes[i], strlen(filter.prefixes[i])) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Count a call in the shard of `self`; returns its file entry
+static inline struct io_fd_stats *account(struct io_thread *self, uint32_t op,
+                                          int fd, size_t count, uint64_t ns) {
+  int slot = fd_slot(fd);
+  uint32_t generation = __atomic_load_n(&fd_generation[slot], __ATOMIC_RELAXED);
+  struct io_fd_stats *stats = self->by_fd[slot];
+  if (!stats || stats->generation != generation) {
+    stats = calloc(1, sizeof(struct io_fd_stats));
+    if (!stats) {
+      return NULL;
+    }
+    stats->generation = generation;
+    stats->fd = slot == IO_MAX_FDS ? -1 : fd;
+    stats->path = fd_path(stats->fd);
+    stats->traced = stats->path && file_traced(stats->fd, stats->path);
+    stats->next = self->stats;
+    __atomic_store_n(&self->stats, stats, __ATOMIC_RELEASE);
+    self->by_fd[slot] = stats;
+  }
+  struct io_op_stats *ops = stats->ops[op];
+  if (!ops) {
+    ops = calloc(1, sizeof(struct io_op_stats));
+    if (!ops) {
+      return stats;
+    }
+    __atomic_store_n(&stats->ops[op], ops, __ATOMIC_RELEASE);
+  }
+  hist_add(&ops->latency, ns);
+  hist_add(&ops->size, count);
+  return stats;
+}
+
+// Queue `buffer` for the flusher, with flush_lock held
+static void enqueue_buffer(struct io_buffer *buffer) {
+  if (!buffer || buffer->used == 0) {
+    return;
+  }
+  buffer->next = NULL;
+  if (flush_tail) {
+    flush_tail->next = buffer;
+  } else {
+    flush_head = buffer;
+  }
+  flush_tail = buffer;
+  pthread_cond_signal(&flush_cond);
+}
+
+// Hand a full buffer over and take an empty one, or NULL after unload
+static struct io_buffer *swap_buffer(struct io_buffer *full) {
+  pthread_mutex_lock(&flush_lock);
+  if (trace_closed) {
+    pthread_mutex_unlock(&flush_lock);
+    return NULL;
+  }
+  enqueue_buffer(full);
+  struct io_buffer *buffer = free_buffers;
+  if (buffer) {
+    free_buffers = buffer->next;
+  } else {
+    buffer = malloc(sizeof(struct io_buffer));
+  }
+  if (buffer) {
+    buffer->used = 0;
+  }
+  pthread_mutex_unlock(&flush_lock);
+  return buffer;
+}
+
+// Queue the buffer of `self`, unless the thread is writing into it. While
+// it writes, `current` is NULL and the buffer belongs to the thread.
+static void take_buffer(struct io_thread *self) {
+  enqueue_buffer(__atomic_exchange_n(&self->current, NULL, __ATOMIC_ACQUIRE));
+}
+
+// On thread exit: its last events still get written
+static void release_thread(void *arg) {
+  pthread_mutex_lock(&flush_lock);
+  if (!trace_closed) {
+    take_buffer(arg);
+  }
+  pthread_mutex_unlock(&flush_lock);
+}
+
+static struct io_thread *register_thread() {
+  struct io_thread *self = calloc(1, sizeof(struct io_thread));
+  if (!self) {
+    return NULL;
+  }
+  self->tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&flush_lock);
+  self->next = threads;
+  threads = self;
+  pthread_mutex_unlock(&flush_lock);
+  pthread_setspecific(thread_key, self);
+  thread_state = self;
+  return self;
+}
+
+static inline struct io_thread *current_thread() {
+  return thread_state ? thread_state : register_thread();
+}
+
+static inline void record_event(struct io_thread *self, uint32_t op, int fd,
+                                int fd2, const void *buf, size_t count,
+                                off_t offset, ssize_t ret, uint64_t start,
+                                uint64_t end) {
+  // Own the buffer while writing, so the unload cannot queue it
+  // underneath; a buffer taken meanwhile is not ours any more
+  struct io_buffer *buffer =
+      __atomic_exchange_n(&self->current, NULL, __ATOMIC_ACQUIRE);
+  if (!buffer || buffer->used == IO_BUFFER_EVENTS) {
+    buffer = swap_buffer(buffer);
+    if (!buffer) {
+      return;
+    }
+  }
+  struct io_event *event = &buffer->events[buffer->used++];
+  event->start_ns = start;
+  event->end_ns = end;
+  event->buf = (uint64_t)(uintptr_t)buf;
+  event->count = count;
+  event->ret = ret;
+  event->offset = offset;
+  event->fd = fd;
+  event->tid = self->tid;
+  event->op = op;
+  event->fd2 = fd2;
+  __atomic_store_n(&self->current, buffer, __ATOMIC_RELEASE);
+}
+
+// Which way the data of `op` moves through the file, or -1
+static inline int op_direction(uint32_t op) {
+  switch (op) {
+  case IO_OP_READ:
+  case IO_OP_PREAD:
+  case IO_OP_READV:
+  case IO_OP_PREADV:
+  case IO_OP_PREADV2:
+  case IO_OP_SENDFILE:
+  case IO_OP_COPY_FILE_RANGE:
+    return IO_DIR_READ;
+  case IO_OP_WRITE:
+  case IO_OP_PWRITE:
+  case IO_OP_WRITEV:
+  case IO_OP_PWRITEV:
+  case IO_OP_PWRITEV2:
+    return IO_DIR_WRITE;
+  default:
+    return -1;
+  }
+}
+
+static inline void set_position(int fd, int64_t offset) {
+  if (fd < 0 || fd >= IO_MAX_FDS) {
+    return;
+  }
+  __atomic_store_n(&fd_position[fd].offset, offset, __ATOMIC_RELAXED);
+  __atomic_store_n(&fd_position[fd].known,
+                   __atomic_load_n(&fd_generation[fd], __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELEASE);
+}
+
+// Ask the kernel on the next call
+static inline void forget_position(int fd) {
+  if (fd >= 0 && fd < IO_MAX_FDS) {
+    __atomic_store_n(&fd_position[fd].known, 0, __ATOMIC_RELEASE);
+  }
+}
+
+// Offset of a call that just moved the file position of `fd` by `moved`
+// bytes, IO_NOT_SEEKABLE or -1. A position not known yet (fds never seen
+// open, O_APPEND, stdio) is asked from the kernel.
+static int64_t advance_position(int fd, int64_t moved) {
+  if (fd < 0 || fd >= IO_MAX_FDS) {
+    return -1;
+  }
+  struct io_position *position = &fd_position[fd];
+  if (__atomic_load_n(&position->known, __ATOMIC_ACQUIRE) !=
+      __atomic_load_n(&fd_generation[fd], __ATOMIC_RELAXED) + 1) {
+    off_t now = system_lseek(fd, 0, SEEK_CUR);
+    set_position(fd, now < 0 ? -1 : now);
+    return now < 0 ? IO_NOT_SEEKABLE : now - moved;
+  }
+  if (__atomic_load_n(&position->offset, __ATOMIC_RELAXED) < 0) {
+    return IO_NOT_SEEKABLE;
+  }
+  return __atomic_fetch_add(&position->offset, moved, __ATOMIC_RELAXED);
+}
+
+static inline void classify(struct io_pattern *pattern, int64_t offset,
+                            uint64_t bytes) {
+  if (offset == IO_NOT_SEEKABLE) {
+    add_relaxed(&pattern->unseekable, 1);
+    return;
+  }
+  int64_t distance = offset - pattern->last;
+  if (offset == pattern->next) {
+    add_relaxed(&pattern->sequential, 1);
+    add_relaxed(&pattern->run, bytes);
+  } else {
+    if (distance == pattern->stride && distance != 0) {
+      add_relaxed(&pattern->strided, 1);
+    } else {
+      add_relaxed(&pattern->random, 1);
+    }
+    if (pattern->run) {
+      hist_add(&pattern->runs, pattern->run);
+    }
+    __atomic_store_n(&pattern->run, bytes, __ATOMIC_RELAXED);
+  }
+  pattern->stride = distance;
+  pattern->last = offset;
+  pattern->next = offset + bytes;
+}
+
+// Every pattern, for merges
+static struct io_pattern *patterns = NULL;
+
+static inline void lock_patterns(int fd) {
+  while (__atomic_test_and_set(&fd_pattern_lock[fd], __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&fd_pattern_lock[fd], __ATOMIC_RELAXED)) {
+      sched_yield();
+    }
+  }
+}
+
+static inline void unlock_patterns(int fd) {
+  __atomic_clear(&fd_pattern_lock[fd], __ATOMIC_RELEASE);
+}
+
+// The pattern of the file of `stats`, with the lock of its fd held
+static struct io_pattern *file_pattern(const struct io_fd_stats *stats,
+                                       int dir) {
+  struct io_pattern *pattern = fd_patterns[stats->fd][dir];
+  if (pattern && pattern->generation == stats->generation) {
+    return pattern;
+  }
+  pattern = calloc(1, sizeof(struct io_pattern));
+  if (!pattern) {
+    return NULL;
+  }
+  pattern->fd = stats->fd;
+  pattern->generation = stats->generation;
+  pattern->dir = dir;
+  pattern->path = stats->path;
+  pthread_mutex_lock(&flush_lock);
+  pattern->link = patterns;
+  __atomic_store_n(&patterns, pattern, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&flush_lock);
+  fd_patterns[stats->fd][dir] = pattern;
+  return pattern;
+}
+
+// Classify an access in the pattern of its open file, with the lock of
+// the fd held. The pattern is per file rather than per thread, so threads
+// that share a stream do not break up each other's runs.
+static void add_access(const struct io_fd_stats *stats, int dir,
+                       int64_t offset, uint64_t bytes) {
+  struct io_pattern *pattern = file_pattern(stats, dir);
+  if (pattern) {
+    classify(pattern, offset, bytes);
+  }
+}
+
+// Account and record one intercepted call
+static inline void trace_call(uint32_t op, int fd, int fd2, const void *buf,
+                              size_t count, off_t offset, ssize_t ret,
+                              uint64_t start, uint64_t end) {
+  // The caller may look at errno of the call
+  int saved_errno = errno;
+  struct io_thread *self = current_thread();
+  struct io_fd_stats *stats =
+      self ? account(self, op, fd, count, end - start) : NULL;
+  int dir = op_direction(op);
+  if (dir >= 0 && fd >= 0 && fd < IO_MAX_FDS) {
+    // Threads sharing the file position take their offsets in the order
+    // their accesses are classified
+    lock_patterns(fd);
+    if (offset == IO_AT_POSITION) {
+      offset = advance_position(fd, ret > 0 ? ret : 0);
+    }
+    if (stats && (offset >= 0 || offset == IO_NOT_SEEKABLE) && ret > 0) {
+      add_access(stats, dir, offset, ret);
+    }
+    unlock_patterns(fd);
+  }
+  offset = offset < 0 ? -1 : offset;
+  if (stats && stats->traced && end - start >= filter.min_ns &&
+      ++self->matched % filter.sample == 0) {
+    add_relaxed(&self->recorded, 1);
+    record_event(self, op, fd, fd2, buf, count, offset, ret, start, end);
+  }
+  errno = saved_errno;
+}
+
+static inline size_t iov_bytes(const struct iovec *iov, int iovcnt) {
+  size_t bytes = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    bytes += iov[i].iov_len;
+  }
+  return bytes;
+}
+
+static void write_all(int fd, const void *data, size_t size) {
+  const char *p = data;
+  while (size > 0) {
+    ssize_t n = system_write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+// Merged shards: one entry per (fd, path) and one per path
+struct io_summary {
+  struct io_fd_stats total;
+  uint64_t recorded;
+  struct io_fd_stats *by_fd;
+  size_t fds;
+  struct io_fd_stats *by_path;
+  size_t paths;
+};
+
+// The entry of `fd` (or any fd, if -1) and `path`, added if missing
+static struct io_fd_stats *summary_entry(struct io_fd_stats **entries,
+                                         size_t *count, int fd,
+                                         const char *path) {
+  for (size_t i = 0; i < *count; ++i) {
+    if ((fd == -1 || (*entries)[i].fd == fd) &&
+        strcmp((*entries)[i].path, path) == 0) {
+      return &(*entries)[i];
+    }
+  }
+  struct io_fd_stats *grown =
+      realloc(*entries, (*count + 1) * sizeof(struct io_fd_stats));
+  if (!grown) {
+    return NULL;
+  }
+  *entries = grown;
+  struct io_fd_stats *entry = &grown[(*count)++];
+  memset(entry, 0, sizeof(*entry));
+  entry->fd = fd;
+  entry->path = (char *)path;
+  return entry;
+}
+
+static void merge_shards(struct io_summary *summary) {
+  memset(summary, 0, sizeof(*summary));
+  // Threads are only ever prepended, so the list from here on is stable
+  pthread_mutex_lock(&flush_lock);
+  struct io_thread *head = threads;
+  pthread_mutex_unlock(&flush_lock);
+
+  for (struct io_pattern *pattern =
+           __atomic_load_n(&patterns, __ATOMIC_ACQUIRE);
+       pattern; pattern = pattern->link) {
+    struct io_fd_stats *entry =
+        summary_entry(&summary->by_path, &summary->paths, -1, pattern->path);
+    int dir = pattern->dir;
+    if (!entry || (!entry->patterns[dir] &&
+                   !(entry->patterns[dir] =
+                         calloc(1, sizeof(struct io_pattern))))) {
+      continue;
+    }
+    merge_pattern(entry->patterns[dir], pattern);
+  }
+
+  for (struct io_thread *t = head; t; t = t->next) {
+    summary->recorded += load_relaxed(&t->recorded);
+    for (struct io_fd_stats *stats =
+             __atomic_load_n(&t->stats, __ATOMIC_ACQUIRE);
+         stats; stats = stats->next) {
+      merge_stats(&summary->total, stats);
+      struct io_fd_stats *entry = summary_entry(
+          &summary->by_fd, &summary->fds, stats->fd, stats->path);
+      if (entry) {
+        merge_stats(entry, stats);
+      }
+      entry = summary_entry(&summary->by_path, &summary->paths, -1,
+                            stats->path);
+      if (entry) {
+        merge_stats(entry, stats);
+      }
+    }
+  }
+}
+
+static void free_stats(struct io_fd_stats *entries, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    for (int op = 0; op < IO_OP_COUNT; ++op) {
+      free(entries[i].ops[op]);
+    }
+    free(entries[i].patterns[IO_DIR_READ]);
+    free(entries[i].patterns[IO_DIR_WRITE]);
+  }
+}
+
+static void write_op_stats(const char *indent,
+                           const struct io_fd_stats *stats) {
+  for (int op = 0; op < IO_OP_COUNT; ++op) {
+    if (!stats->ops[op]) {
+      continue;
+    }
+    const struct io_hist *size = &stats->ops[op]->size;
+    const struct io_hist *latency = &stats->ops[op]->latency;
+    double sf = config.size_fractor, tf = config.time_fractor / 1e9;
+    dprintf(config.output_fd, "%s%s: %lu calls\n", indent, io_op_name(op),
+            latency->count);
+    dprintf(config.output_fd,
+            "%s  Size (avg/p50/p99/p999/max): %f / %f / %f / %f / %f\n",
+            indent, (double)size->sum / size->count * sf,
+            hist_percentile(size, 0.5) * sf, hist_percentile(size, 0.99) * sf,
+            hist_percentile(size, 0.999) * sf, size->max * sf);
+    dprintf(config.output_fd,
+            "%s  Time (avg/p50/p99/p999/max): %f / %f / %f / %f / %f\n",
+            indent, (double)latency->sum / latency->count * tf,
+            hist_percentile(latency, 0.5) * tf,
+            hist_percentile(latency, 0.99) * tf,
+            hist_percentile(latency, 0.999) * tf, latency->max * tf);
+  }
+}
+
+// Requests below this are small: readahead and the per-call cost dominate
+#define IO_SMALL_REQUEST (64 * 1024)
+
+// Classify the reads or writes of one file and point out what would help
+static void write_pattern(const struct io_fd_stats *stats, int dir) {
+  const struct io_pattern *pattern = stats->patterns[dir];
+  const char *name = dir == IO_DIR_READ ? "read" : "write";
+  if (pattern->unseekable) {
+    dprintf(config.output_fd, "  %s: not seekable, %lu accesses\n", name,
+            pattern->unseekable);
+  }
+  uint64_t accesses = pattern->sequential + pattern->strided + pattern->random;
+  if (!accesses) {
+    return;
+  }
+  // Request sizes of all calls of this direction
+  struct io_hist *sizes = calloc(1, sizeof(struct io_hist));
+  if (!sizes) {
+    return;
+  }
+  for (int op = 0; op < IO_OP_COUNT; ++op) {
+    if (stats->ops[op] && op_direction(op) == dir) {
+      hist_merge(sizes, &stats->ops[op]->size);
+    }
+  }
+
+  const char *kind = "sequential";
+  uint64_t most = pattern->sequential;
+  if (pattern->strided > most) {
+    kind = "strided";
+    most = pattern->strided;
+  }
+  if (pattern->random > most) {
+    kind = "random";
+  }
+  double sf = config.size_fractor;
+  dprintf(config.output_fd,
+          "  %s: %s, %lu accesses (sequential/strided/random %.1f%% / %.1f%% "
+          "/ %.1f%%)\n",
+          name, kind, accesses, 100.0 * pattern->sequential / accesses,
+          100.0 * pattern->strided / accesses,
+          100.0 * pattern->random / accesses);
+  dprintf(config.output_fd,
+          "    Run (avg/p50/p99/max): %f / %f / %f / %f, %lu runs\n",
+          (double)pattern->runs.sum / pattern->runs.count * sf,
+          hist_percentile(&pattern->runs, 0.5) * sf,
+          hist_percentile(&pattern->runs, 0.99) * sf, pattern->runs.max * sf,
+          pattern->runs.count);
+  dprintf(config.output_fd, "    Request (p50/p99/max): %f / %f / %f\n",
+          hist_percentile(sizes, 0.5) * sf, hist_percentile(sizes, 0.99) * sf,
+          sizes->max * sf);
 
-size_t read_count = 0;
-size_t write_count = 0;
+  uint64_t median = hist_percentile(sizes, 0.5);
+  if (dir == IO_DIR_READ && median < IO_SMALL_REQUEST) {
+    if (pattern->random * 2 > accesses) {
+      dprintf(config.output_fd,
+              "    ! Small random reads dominate: batch them (preadv, "
+              "io_uring), read bigger blocks or cache\n");
+    } else if (pattern->runs.count &&
+               pattern->runs.sum / pattern->runs.count >= IO_SMALL_REQUEST) {
+      dprintf(config.output_fd,
+              "    ! Long sequential runs in small reads: bigger reads or "
+              "more readahead would pay off\n");
+    }
+  }
+  free(sizes);
+}
 
-size_t read_size = 0;
-size_t write_size = 0;
+// Merge the shards of all threads and write them to io.log
+static void write_summary(const char *title) {
+  struct io_summary summary;
+  merge_shards(&summary);
 
-double read_time = 0;
-double write_time = 0;
+  // The classic lines cover read and write only
+  static const struct io_op_stats none;
+  const struct io_op_stats *reads = summary.total.ops[IO_OP_READ];
+  const struct io_op_stats *writes = summary.total.ops[IO_OP_WRITE];
+  reads = reads ? reads : &none;
+  writes = writes ? writes : &none;
+  const struct io_hist *read_size = &reads->size;
+  const struct io_hist *write_size = &writes->size;
+  const struct io_hist *read_time = &reads->latency;
+  const struct io_hist *write_time = &writes->latency;
+  double sf = config.size_fractor, tf = config.time_fractor / 1e9;
+
+  dprintf(config.output_fd, "\n# %s\n\n", title);
+  dprintf(config.output_fd, "Count (R/W): %lu / %lu\n", read_time->count,
+          write_time->count);
+
+  dprintf(config.output_fd, "Size (RA/RT/WA/WT): %f / %f / %f / %f\n",
+          (double)read_size->sum / read_size->count * sf, read_size->sum * sf,
+          (double)write_size->sum / write_size->count * sf,
+          write_size->sum * sf);
+
+  dprintf(config.output_fd, "Time (RA/RT/WA/WT): %f / %f / %f / %f\n",
+          (double)read_time->sum / read_time->count * tf, read_time->sum * tf,
+          (double)write_time->sum / write_time->count * tf,
+          write_time->sum * tf);
+
+  uint64_t calls = 0;
+  for (int op = 0; op < IO_OP_COUNT; ++op) {
+    calls += summary.total.ops[op] ? summary.total.ops[op]->latency.count : 0;
+  }
+  dprintf(config.output_fd, "Traced (calls/all): %lu / %lu\n",
+          summary.recorded, calls);
+
+  dprintf(config.output_fd, "\n## By call\n\n");
+  write_op_stats("", &summary.total);
+
+  dprintf(config.output_fd, "\n## By fd\n");
+  for (size_t i = 0; i < summary.fds; ++i) {
+    if (summary.by_fd[i].fd < 0) {
+      dprintf(config.output_fd, "\n%s\n", summary.by_fd[i].path);
+    } else {
+      dprintf(config.output_fd, "\nfd %d (%s)\n", summary.by_fd[i].fd,
+              summary.by_fd[i].path);
+    }
+    write_op_stats("  ", &summary.by_fd[i]);
+  }
+
+  dprintf(config.output_fd, "\n## By path\n");
+  for (size_t i = 0; i < summary.paths; ++i) {
+    dprintf(config.output_fd, "\n%s\n", summary.by_path[i].path);
+    write_op_stats("  ", &summary.by_path[i]);
+  }
+
+  dprintf(config.output_fd, "\n## Access patterns\n\n");
+  dprintf(config.output_fd, "Per open file over all threads, in call order\n");
+  for (size_t i = 0; i < summary.paths; ++i) {
+    const struct io_fd_stats *stats = &summary.by_path[i];
+    if (!stats->patterns[IO_DIR_READ] && !stats->patterns[IO_DIR_WRITE]) {
+      continue;
+    }
+    dprintf(config.output_fd, "\n%s\n", stats->path);
+    for (int dir = IO_DIR_READ; dir <= IO_DIR_WRITE; ++dir) {
+      if (stats->patterns[dir]) {
+        write_pattern(stats, dir);
+      }
+    }
+  }
+
+  free_stats(&summary.total, 1);
+  free_stats(summary.by_fd, summary.fds);
+  free_stats(summary.by_path, summary.paths);
+  free(summary.by_fd);
+  free(summary.by_path);
+}
+
+static void *flush_loop(void *arg) {
+  (void)arg;
+  uint64_t next_snapshot = config.snapshot_ns ? now_ns() + config.snapshot_ns
+                                              : 0;
+  pthread_mutex_lock(&flush_lock);
+  for (;;) {
+    while (!flush_head && !flush_stop) {
+      if (!next_snapshot) {
+        pthread_cond_wait(&flush_cond, &flush_lock);
+        continue;
+      }
+      uint64_t now = now_ns();
+      if (now >= next_snapshot) {
+        pthread_mutex_unlock(&flush_lock);
+        write_summary("SNAPSHOT");
+        pthread_mutex_lock(&flush_lock);
+        next_snapshot = now + config.snapshot_ns;
+        continue;
+      }
+      // The condition variable waits on CLOCK_REALTIME
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      uint64_t wait = next_snapshot - now;
+      deadline.tv_sec += wait / 1000000000;
+      deadline.tv_nsec += wait % 1000000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&flush_cond, &flush_lock, &deadline);
+    }
+    struct io_buffer *buffer = flush_head;
+    if (!buffer) {
+      break;
+    }
+    flush_head = buffer->next;
+    if (!flush_head) {
+      flush_tail = NULL;
+    }
+    pthread_mutex_unlock(&flush_lock);
+
+    write_all(config.trace_fd, buffer->events,
+              buffer->used * sizeof(struct io_event));
+
+    pthread_mutex_lock(&flush_lock);
+    buffer->used = 0;
+    buffer->next = free_buffers;
+    free_buffers = buffer;
+  }
+  pthread_mutex_unlock(&flush_lock);
+  return NULL;
+}
+
+// A forked child has only the thread that called fork: not the flusher,
+// and not the threads whose buffers and shards it inherits. Those belong
+// to the parent, which writes them, so the child drops them and starts
+// over with a flusher of its own on the same trace and output files.
+static void fork_prepare() { pthread_mutex_lock(&flush_lock); }
+
+static void fork_parent() { pthread_mutex_unlock(&flush_lock); }
+
+static void fork_child() {
+  // Nobody is left to release the lock or wait on the condition
+  pthread_mutex_init(&flush_lock, NULL);
+  pthread_cond_init(&flush_cond, NULL);
+  memset(fd_pattern_lock, 0, sizeof(fd_pattern_lock));
+
+  // Queued buffers are written by the parent, here they are only memory
+  while (flush_head) {
+    struct io_buffer *buffer = flush_head;
+    flush_head = buffer->next;
+    buffer->next = free_buffers;
+    free_buffers = buffer;
+  }
+  flush_tail = NULL;
+  threads = NULL;
+  thread_state = NULL;
+  pthread_setspecific(thread_key, NULL);
+  patterns = NULL;
+  memset(fd_patterns, 0, sizeof(fd_patterns));
+  // The parent moves the offsets of the files it shares with the child
+  memset(fd_position, 0, sizeof(fd_position));
+
+  forked = 1;
+  flush_stop = 0;
+  flusher_running = 0;
+  if (!trace_closed) {
+    if (pthread_create(&flusher, NULL, flush_loop, NULL) == 0) {
+      flusher_running = 1;
+    } else {
+      printf("CSPM: [ERROR] Cannot start the trace flusher\n");
+    }
+  }
+}
+
+// A -p prefix as an absolute path: a relative one is taken from the
+// working directory at load, and symlinks are resolved where the path
+// exists. A trailing slash is kept, so "data/" does not match "data2".
+static char *absolute_prefix(const char *prefix) {
+  char path[PATH_MAX];
+  size_t len = strlen(prefix);
+  if (realpath(prefix, path)) {
+    // Resolved
+  } else if (prefix[0] == '/') {
+    if (len >= sizeof(path)) {
+      return NULL;
+    }
+    memcpy(path, prefix, len + 1);
+  } else {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)) ||
+        snprintf(path, sizeof(path), "%s/%s", strcmp(cwd, "/") ? cwd : "",
+                 prefix) >= (int)sizeof(path)) {
+      return NULL;
+    }
+  }
+  size_t n = strlen(path);
+  if (len && prefix[len - 1] == '/' && path[n - 1] != '/' &&
+      n + 1 < sizeof(path)) {
+    path[n] = '/';
+    path[n + 1] = 0;
+  }
+  return strdup(path);
+}
+
+// The trace filter, for the config output
+static void describe_filter(char *out, size_t size) {
+  FILE *fp = fmemopen(out, size, "w");
+  if (!fp) {
+    out[0] = 0;
+    return;
+  }
+  fprintf(fp, "prefixes");
+  for (int i = 0; i < filter.prefix_count; ++i) {
+    fprintf(fp, " %s", filter.prefixes[i]);
+  }
+  fprintf(fp, "%s; fds", filter.prefix_count ? "" : " any");
+  for (int fd = 0; fd < IO_MAX_FDS && filter.by_fd; ++fd) {
+    if (filter.fds[fd]) {
+      fprintf(fp, " %d", fd);
+    }
+  }
+  fprintf(fp, "%s; latency >= %lu ns; 1 in %lu", filter.by_fd ? "" : " any",
+          filter.min_ns, filter.sample);
+  fclose(fp);
+}
+
+// Resolve every intercepted call once. Also run by the wrappers while
+// unresolved, for calls from constructors that run before ours.
+static void resolve_symbols() {
+  system_read = (ssize_t(*)(int, void *, size_t))dlsym(RTLD_NEXT, "read");
+  system_write =
+      (ssize_t(*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+  system_pread =
+      (ssize_t(*)(int, void *, size_t, off_t))dlsym(RTLD_NEXT, "pread");
+  system_pwrite =
+      (ssize_t(*)(int, const void *, size_t, off_t))dlsym(RTLD_NEXT, "pwrite");
+  system_readv = (ssize_t(*)(int, const struct iovec *, int))dlsym(
+      RTLD_NEXT, "readv");
+  system_writev = (ssize_t(*)(int, const struct iovec *, int))dlsym(
+      RTLD_NEXT, "writev");
+  system_preadv = (ssize_t(*)(int, const struct iovec *, int, off_t))dlsym(
+      RTLD_NEXT, "preadv");
+  system_pwritev = (ssize_t(*)(int, const struct iovec *, int, off_t))dlsym(
+      RTLD_NEXT, "pwritev");
+  system_preadv2 = (ssize_t(*)(int, const struct iovec *, int, off_t,
+                               int))dlsym(RTLD_NEXT, "preadv2");
+  system_pwritev2 = (ssize_t(*)(int, const struct iovec *, int, off_t,
+                                int))dlsym(RTLD_NEXT, "pwritev2");
+  system_fsync = (int (*)(int))dlsym(RTLD_NEXT, "fsync");
+  system_fdatasync = (int (*)(int))dlsym(RTLD_NEXT, "fdatasync");
+  system_sendfile = (ssize_t(*)(int, int, off_t *, size_t))dlsym(
+      RTLD_NEXT, "sendfile");
+  system_copy_file_range =
+      (ssize_t(*)(int, off_t *, int, off_t *, size_t, unsigned int))dlsym(
+          RTLD_NEXT, "copy_file_range");
+  system_mmap = (void *(*)(void *, size_t, int, int, int, off_t))dlsym(
+      RTLD_NEXT, "mmap");
+  system_open = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, "open");
+  system_openat =
+      (int (*)(int, const char *, int, ...))dlsym(RTLD_NEXT, "openat");
+  system_close = (int (*)(int))dlsym(RTLD_NEXT, "close");
+  system_lseek = (off_t(*)(int, off_t, int))dlsym(RTLD_NEXT, "lseek");
+  system_fopen =
+      (FILE * (*)(const char *, const char *)) dlsym(RTLD_NEXT, "fopen");
+  system_freopen = (FILE * (*)(const char *, const char *, FILE *))
+      dlsym(RTLD_NEXT, "freopen");
+  system_fdopen = (FILE * (*)(int, const char *)) dlsym(RTLD_NEXT, "fdopen");
+  system_fclose = (int (*)(FILE *))dlsym(RTLD_NEXT, "fclose");
+}
+
+#define RESOLVE(name)                                                          \
+  if (__builtin_expect(!system_##name, 0)) {                                   \
+    resolve_symbols();                                                         \
+  }
 
 void __attribute__((constructor)) load_cspm_io() {
   printf("====================\n");
@@ -35,28 +1129,43 @@ void __attribute__((constructor)) load_cspm_io() {
 
   // Loading config from env "CSPM_IO" via getopt
   // -o <output file>
+  // -b <binary trace file>
   // -s <size unit> (B, KB, MB, GB)
   // -t <time unit> (s, ms, us, ns)
+  // -i <snapshot interval in seconds>
+  // Trace filters, the summary still counts everything:
+  // -p <path prefix> (repeatable, any matches; relative to the working
+  //    directory unless absolute)
+  // -d <fd>[,<fd>...]
+  // -l <minimum latency in us>
+  // -n <keep 1 in N of the remaining calls>
   char *env = getenv("CSPM_IO");
   env = env ? env : "";
   printf("CSPM: [INFO] env CSPM_IO: %s\n", env);
   int argc = 1;
-  char *argv[10];
+  char *argv[64];
   argv[0] = "cspm_io"; // pseudo argv[0]
 
   char *token = strtok(env, " ");
   while (token) {
+    if (argc == 63) {
+      printf("CSPM: [ERROR] Too many options in CSPM_IO\n");
+      exit(1);
+    }
     argv[argc++] = token;
     token = strtok(NULL, " ");
   }
+  argv[argc] = NULL;
 
   char *output_file_name = "io.log";
+  char *trace_file_name = "io.trace";
   char size_unit = 'B';
   char time_unit = 's';
+  double snapshot_interval = 0;
 
   optind = 0;
   int opt;
-  while ((opt = getopt(argc, argv, "s:t:o:")) != -1) {
+  while ((opt = getopt(argc, argv, "s:t:o:b:i:p:d:l:n:")) != -1) {
     switch (opt) {
     case 'o':
       if (!optarg) {
@@ -65,12 +1174,56 @@ void __attribute__((constructor)) load_cspm_io() {
       }
       output_file_name = optarg;
       break;
+    case 'b':
+      trace_file_name = optarg;
+      break;
     case 's':
       size_unit = optarg[0];
       break;
     case 't':
       time_unit = optarg[0];
       break;
+    case 'i':
+      snapshot_interval = atof(optarg);
+      if (snapshot_interval < 0) {
+        printf("CSPM: [ERROR] Usage: -i <snapshot interval in seconds>\n");
+        exit(1);
+      }
+      break;
+    case 'p':
+      if (filter.prefix_count == IO_MAX_PREFIXES) {
+        printf("CSPM: [ERROR] At most %d path prefixes\n", IO_MAX_PREFIXES);
+        exit(1);
+      }
+      filter.prefixes[filter.prefix_count] = absolute_prefix(optarg);
+      if (!filter.prefixes[filter.prefix_count]) {
+        printf("CSPM: [ERROR] Cannot resolve path prefix: %s\n", optarg);
+        exit(1);
+      }
+      ++filter.prefix_count;
+      break;
+    case 'd':
+      filter.by_fd = 1;
+      for (char *fd = strtok(optarg, ","); fd; fd = strtok(NULL, ",")) {
+        int n = atoi(fd);
+        if (n < 0 || n >= IO_MAX_FDS) {
+          printf("CSPM: [ERROR] Usage: -d <fd>[,<fd>...] with fds below %d\n",
+                 IO_MAX_FDS);
+          exit(1);
+        }
+        filter.fds[n] = 1;
+      }
+      break;
+    case 'l':
+      filter.min_ns = (uint64_t)(atof(optarg) * 1e3);
+      break;
+    case 'n':
+      filter.sample = strtoull(optarg, NULL, 10);
+      if (filter.sample == 0) {
+        printf("CSPM: [ERROR] Usage: -n <N>, N >= 1\n");
+        exit(1);
+      }
+      break;
     default:
       printf("CSPM: [ERROR] Invalid option: %c\n", opt);
       exit(1);
@@ -79,12 +1232,23 @@ void __attribute__((constructor)) load_cspm_io() {
   }
   optind = 0;
 
-  config.output_fd = open(output_file_name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  // Our own files are not traced
+  resolve_symbols();
+
+  config.output_fd =
+      system_open(output_file_name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
   if (config.output_fd == -1) {
     printf("CSPM: [ERROR] Cannot open output file: %s\n", output_file_name);
     exit(1);
   }
 
+  config.trace_fd =
+      system_open(trace_file_name, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (config.trace_fd == -1) {
+    printf("CSPM: [ERROR] Cannot open trace file: %s\n", trace_file_name);
+    exit(1);
+  }
+
   switch (size_unit) {
   case 'B':
     config.size_fractor = 1;
@@ -103,6 +1267,7 @@ void __attribute__((constructor)) load_cspm_io() {
     printf("CSPM: [ERROR] Invalid size unit: %c. Using default (Byte).\n",
            size_unit);
     config.size_fractor = 1;
+    size_unit = 'B';
     break;
   }
 
@@ -124,18 +1289,41 @@ void __attribute__((constructor)) load_cspm_io() {
     printf("CSPM: [ERROR] Invalid time unit: %c. Using default (Second).\n",
            time_unit);
     config.time_fractor = 1;
+    time_unit = 's';
     break;
   }
 
-  system_read = (ssize_t(*)(int, void *, size_t))dlsym(RTLD_NEXT, "read");
-  system_write =
-      (ssize_t(*)(int, const void *, size_t))dlsym(RTLD_NEXT, "write");
+  struct io_trace_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IO_TRACE_MAGIC, sizeof(header.magic));
+  header.version = IO_TRACE_VERSION;
+  header.event_size = sizeof(struct io_event);
+  header.size_unit = size_unit;
+  header.time_unit = time_unit;
+  write_all(config.trace_fd, &header, sizeof(header));
+
+  config.snapshot_ns = (uint64_t)(snapshot_interval * 1e9);
+
+  pthread_key_create(&thread_key, release_thread);
+  if (pthread_create(&flusher, NULL, flush_loop, NULL) == 0) {
+    flusher_running = 1;
+  } else {
+    printf("CSPM: [ERROR] Cannot start the trace flusher\n");
+  }
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
 
   // Print config
   printf("CSPM: [INFO] Config:\n");
   printf("CSPM: [INFO]   Output file: %s\n", output_file_name);
+  printf("CSPM: [INFO]   Trace file: %s\n", trace_file_name);
   printf("CSPM: [INFO]   Size unit: %c\n", size_unit);
   printf("CSPM: [INFO]   Time unit: %c\n", time_unit);
+  if (snapshot_interval > 0) {
+    printf("CSPM: [INFO]   Snapshot interval: %f s\n", snapshot_interval);
+  }
+  char trace_filter[1024];
+  describe_filter(trace_filter, sizeof(trace_filter));
+  printf("CSPM: [INFO]   Trace filter: %s\n", trace_filter);
   printf("====================\n\n");
 
   // Dump basic info
@@ -145,77 +1333,347 @@ void __attribute__((constructor)) load_cspm_io() {
   dprintf(config.output_fd, "Size unit: %c\n", size_unit);
   dprintf(config.output_fd, "Time unit: %c\n\n", time_unit);
   dprintf(config.output_fd, "# TRACE\n\n");
+  dprintf(config.output_fd, "Binary trace: %s (decode with io_decode)\n",
+          trace_file_name);
+  dprintf(config.output_fd, "Trace filter: %s\n", trace_filter);
 }
 
 void __attribute__((destructor)) unload_cspm_io() {
   printf("====================\n");
   printf("CSPM: [INFO] Unloading CSPM IO\n");
 
-  // Calculate average size, time
-  double avg_read_size = (double)read_size / (double)read_count;
-  double avg_write_size = (double)write_size / (double)write_count;
+  // Flush what every thread has buffered, then stop the flusher. Threads
+  // still doing I/O keep their buffer, and their later events are dropped.
+  pthread_mutex_lock(&flush_lock);
+  trace_closed = 1;
+  for (struct io_thread *t = threads; t; t = t->next) {
+    take_buffer(t);
+  }
+  flush_stop = 1;
+  pthread_cond_signal(&flush_cond);
+  pthread_mutex_unlock(&flush_lock);
+  if (flusher_running) {
+    pthread_join(flusher, NULL);
+  }
+  system_close(config.trace_fd);
 
-  double avg_read_time = read_time / (double)read_count;
-  double avg_write_time = write_time / (double)write_count;
+  if (forked) {
+    char title[64];
+    snprintf(title, sizeof(title), "SUMMARY of forked pid %d", getpid());
+    write_summary(title);
+  } else {
+    write_summary("SUMMARY");
+  }
 
-  dprintf(config.output_fd, "\n# SUMMARY\n\n");
-  dprintf(config.output_fd, "Count (R/W): %lu / %lu\n", read_count,
-          write_count);
+  system_close(config.output_fd);
+  printf("====================\n\n");
+}
 
-  dprintf(config.output_fd, "Size (RA/RT/WA/WT): %f / %f / %f / %f\n",
-          avg_read_size * config.size_fractor, read_size * config.size_fractor,
-          avg_write_size * config.size_fractor,
-          write_size * config.size_fractor);
+ssize_t read(int fd, void *buf, size_t count) {
+  RESOLVE(read);
+  uint64_t start = now_ns();
+  ssize_t ret = system_read(fd, buf, count);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_READ, fd, -1, buf, count, IO_AT_POSITION, ret, start,
+             end);
+  return ret;
+}
 
-  dprintf(config.output_fd, "Time (RA/RT/WA/WT): %f / %f / %f / %f\n",
-          avg_read_time * config.time_fractor, read_time * config.time_fractor,
-          avg_write_time * config.time_fractor,
-          write_time * config.time_fractor);
+ssize_t write(int fd, const void *buf, size_t count) {
+  RESOLVE(write);
+  uint64_t start = now_ns();
+  ssize_t ret = system_write(fd, buf, count);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_WRITE, fd, -1, buf, count, IO_AT_POSITION, ret, start,
+             end);
+  return ret;
+}
 
-  close(config.output_fd);
-  printf("====================\n\n");
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  RESOLVE(pread);
+  uint64_t start = now_ns();
+  ssize_t ret = system_pread(fd, buf, count, offset);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_PREAD, fd, -1, buf, count, offset, ret, start, end);
+  return ret;
 }
 
-ssize_t read(int fd, void *buf, size_t count) {
-  struct timespec start, end;
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  RESOLVE(pwrite);
+  uint64_t start = now_ns();
+  ssize_t ret = system_pwrite(fd, buf, count, offset);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_PWRITE, fd, -1, buf, count, offset, ret, start, end);
+  return ret;
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-  ssize_t ret = system_read(fd, buf, count);
-  clock_gettime(CLOCK_MONOTONIC, &end);
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+  RESOLVE(readv);
+  uint64_t start = now_ns();
+  ssize_t ret = system_readv(fd, iov, iovcnt);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_READV, fd, -1, iov, iov_bytes(iov, iovcnt), IO_AT_POSITION,
+             ret, start, end);
+  return ret;
+}
 
-  double start_time = (double)start.tv_sec + (double)start.tv_nsec / 1e9;
-  double end_time = (double)end.tv_sec + (double)end.tv_nsec / 1e9;
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+  RESOLVE(writev);
+  uint64_t start = now_ns();
+  ssize_t ret = system_writev(fd, iov, iovcnt);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_WRITEV, fd, -1, iov, iov_bytes(iov, iovcnt), IO_AT_POSITION,
+             ret, start, end);
+  return ret;
+}
 
-  read_count += 1;
-  read_size += count;
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  RESOLVE(preadv);
+  uint64_t start = now_ns();
+  ssize_t ret = system_preadv(fd, iov, iovcnt, offset);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_PREADV, fd, -1, iov, iov_bytes(iov, iovcnt), offset, ret,
+             start, end);
+  return ret;
+}
 
-  read_time += end_time - start_time;
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  RESOLVE(pwritev);
+  uint64_t start = now_ns();
+  ssize_t ret = system_pwritev(fd, iov, iovcnt, offset);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_PWRITEV, fd, -1, iov, iov_bytes(iov, iovcnt), offset, ret,
+             start, end);
+  return ret;
+}
 
-  dprintf(config.output_fd, "- read (%d, %p, %lu) = %zd [%.4f](%f-%f)\n", fd,
-          buf, count, ret, (end_time - start_time) * config.time_fractor,
-          start_time, end_time);
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                int flags) {
+  RESOLVE(preadv2);
+  uint64_t start = now_ns();
+  ssize_t ret = system_preadv2(fd, iov, iovcnt, offset, flags);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_PREADV2, fd, -1, iov, iov_bytes(iov, iovcnt),
+             offset == -1 ? IO_AT_POSITION : offset, ret, start, end);
+  return ret;
+}
 
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                 int flags) {
+  RESOLVE(pwritev2);
+  uint64_t start = now_ns();
+  ssize_t ret = system_pwritev2(fd, iov, iovcnt, offset, flags);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_PWRITEV2, fd, -1, iov, iov_bytes(iov, iovcnt),
+             offset == -1 ? IO_AT_POSITION : offset, ret, start, end);
   return ret;
 }
 
-ssize_t write(int fd, const void *buf, size_t count) {
-  struct timespec start, end;
+int fsync(int fd) {
+  RESOLVE(fsync);
+  uint64_t start = now_ns();
+  int ret = system_fsync(fd);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_FSYNC, fd, -1, NULL, 0, -1, ret, start, end);
+  return ret;
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-  ssize_t ret = system_write(fd, buf, count);
-  clock_gettime(CLOCK_MONOTONIC, &end);
+int fdatasync(int fd) {
+  RESOLVE(fdatasync);
+  uint64_t start = now_ns();
+  int ret = system_fdatasync(fd);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_FDATASYNC, fd, -1, NULL, 0, -1, ret, start, end);
+  return ret;
+}
 
-  double start_time = (double)start.tv_sec + (double)start.tv_nsec / 1e9;
-  double end_time = (double)end.tv_sec + (double)end.tv_nsec / 1e9;
+// The destination of sendfile and copy_file_range moves as well
+static inline void move_position(int fd, ssize_t moved) {
+  if (moved > 0) {
+    int saved_errno = errno;
+    advance_position(fd, moved);
+    errno = saved_errno;
+  }
+}
+
+// Accounted to the source fd, which is the file of the usual file to
+// socket copy
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+  RESOLVE(sendfile);
+  off_t from = offset ? *offset : IO_AT_POSITION;
+  uint64_t start = now_ns();
+  ssize_t ret = system_sendfile(out_fd, in_fd, offset, count);
+  uint64_t end = now_ns();
+  move_position(out_fd, ret);
+  trace_call(IO_OP_SENDFILE, in_fd, out_fd, NULL, count, from, ret, start,
+             end);
+  return ret;
+}
+
+ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+                        size_t len, unsigned int flags) {
+  RESOLVE(copy_file_range);
+  off_t from = off_in ? *off_in : IO_AT_POSITION;
+  uint64_t start = now_ns();
+  ssize_t ret = system_copy_file_range(fd_in, off_in, fd_out, off_out, len,
+                                       flags);
+  uint64_t end = now_ns();
+  if (!off_out) {
+    move_position(fd_out, ret);
+  }
+  trace_call(IO_OP_COPY_FILE_RANGE, fd_in, fd_out, NULL, len, from, ret, start,
+             end);
+  return ret;
+}
+
+// Only file mappings are traced. Allocators call mmap for anonymous memory,
+// possibly from inside dlsym, so those go straight to the kernel until the
+// symbols are resolved.
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  if (__builtin_expect(!system_mmap, 0)) {
+    return (void *)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+  }
+  if (flags & MAP_ANONYMOUS) {
+    return system_mmap(addr, length, prot, flags, fd, offset);
+  }
+  uint64_t start = now_ns();
+  void *ret = system_mmap(addr, length, prot, flags, fd, offset);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_MMAP, fd, -1, addr, length, offset, (ssize_t)ret, start,
+             end);
+  return ret;
+}
+
+// The fd of a successful open is a new file: later calls get new stats.
+// Appends start at the end, which the kernel knows.
+static inline void fd_opened(int fd, int flags) {
+  if (fd >= 0) {
+    __atomic_add_fetch(&fd_generation[fd_slot(fd)], 1, __ATOMIC_RELAXED);
+    if (!(flags & O_APPEND)) {
+      set_position(fd, 0);
+    }
+  }
+}
+
+static inline void fd_closed(int fd) {
+  __atomic_add_fetch(&fd_generation[fd_slot(fd)], 1, __ATOMIC_RELAXED);
+}
+
+static inline mode_t open_mode(int flags, va_list args) {
+  int needs_mode = (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE;
+  return needs_mode ? va_arg(args, mode_t) : 0;
+}
 
-  write_count += 1;
-  write_size += count;
+int open(const char *path, int flags, ...) {
+  RESOLVE(open);
+  va_list args;
+  va_start(args, flags);
+  mode_t mode = open_mode(flags, args);
+  va_end(args);
+  uint64_t start = now_ns();
+  int ret = system_open(path, flags, mode);
+  uint64_t end = now_ns();
+  fd_opened(ret, flags);
+  trace_call(IO_OP_OPEN, ret, -1, NULL, 0, -1, ret, start, end);
+  return ret;
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+  RESOLVE(openat);
+  va_list args;
+  va_start(args, flags);
+  mode_t mode = open_mode(flags, args);
+  va_end(args);
+  uint64_t start = now_ns();
+  int ret = system_openat(dirfd, path, flags, mode);
+  uint64_t end = now_ns();
+  fd_opened(ret, flags);
+  trace_call(IO_OP_OPENAT, ret, -1, NULL, 0, -1, ret, start, end);
+  return ret;
+}
+
+int close(int fd) {
+  RESOLVE(close);
+  uint64_t start = now_ns();
+  int ret = system_close(fd);
+  uint64_t end = now_ns();
+  trace_call(IO_OP_CLOSE, fd, -1, NULL, 0, -1, ret, start, end);
+  if (ret == 0) {
+    fd_closed(fd);
+  }
+  return ret;
+}
+
+off_t lseek(int fd, off_t offset, int whence) {
+  RESOLVE(lseek);
+  uint64_t start = now_ns();
+  off_t ret = system_lseek(fd, offset, whence);
+  uint64_t end = now_ns();
+  if (ret >= 0) {
+    set_position(fd, ret);
+  }
+  trace_call(IO_OP_LSEEK, fd, -1, NULL, 0, -1, ret, start, end);
+  return ret;
+}
 
-  write_time += end_time - start_time;
+// stdio opens and closes through internal calls, so its streams are only
+// bookkept here: a new stream is a new file at a position only the kernel
+// knows (the "a" modes append)
+FILE *fopen(const char *path, const char *mode) {
+  RESOLVE(fopen);
+  FILE *fp = system_fopen(path, mode);
+  if (fp) {
+    fd_closed(fileno(fp));
+  }
+  return fp;
+}
 
-  dprintf(config.output_fd, "- write (%d, %p, %lu) = %zd [%.4f](%f-%f)\n", fd,
-          buf, count, ret, (end_time - start_time) * config.time_fractor,
-          start_time, end_time);
+FILE *freopen(const char *path, const char *mode, FILE *stream) {
+  RESOLVE(freopen);
+  FILE *fp = system_freopen(path, mode, stream);
+  if (fp) {
+    fd_closed(fileno(fp));
+  }
+  return fp;
+}
 
+// Same file, but the mode may append
+FILE *fdopen(int fd, const char *mode) {
+  RESOLVE(fdopen);
+  FILE *fp = system_fdopen(fd, mode);
+  if (fp) {
+    forget_position(fd);
+  }
+  return fp;
+}
+
+int fclose(FILE *stream) {
+  RESOLVE(fclose);
+  int fd = fileno(stream);
+  int ret = system_fclose(stream);
+  if (fd >= 0) {
+    fd_closed(fd);
+  }
   return ret;
 }
+
+// With 64-bit off_t the *64 variants, which _FILE_OFFSET_BITS=64 builds
+// call, are the same functions
+#ifdef __OFF_T_MATCHES_OFF64_T
+#define IO_ALIAS(name, target)                                                 \
+  extern __typeof__(target) name __attribute__((alias(#target)))
+IO_ALIAS(pread64, pread);
+IO_ALIAS(pwrite64, pwrite);
+IO_ALIAS(preadv64, preadv);
+IO_ALIAS(pwritev64, pwritev);
+IO_ALIAS(preadv64v2, preadv2);
+IO_ALIAS(pwritev64v2, pwritev2);
+IO_ALIAS(sendfile64, sendfile);
+IO_ALIAS(mmap64, mmap);
+IO_ALIAS(open64, open);
+IO_ALIAS(openat64, openat);
+IO_ALIAS(lseek64, lseek);
+IO_ALIAS(fopen64, fopen);
+IO_ALIAS(freopen64, freopen);
+#endif
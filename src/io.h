@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+
+// Binary trace of libcspmio.so, decoded by io_decode.
+//
+// The file is an io_trace_header followed by io_events. Every thread fills
+// its own buffers, so events are grouped by thread and in order within a
+// thread, not across threads.
+
+#define IO_TRACE_MAGIC "CSPMIOTR"
+#define IO_TRACE_VERSION 2
+
+// One per intercepted call; the 64-bit offset variants (pread64, ...) count
+// as the plain call
+enum io_op {
+  IO_OP_READ,
+  IO_OP_WRITE,
+  IO_OP_PREAD,
+  IO_OP_PWRITE,
+  IO_OP_READV,
+  IO_OP_WRITEV,
+  IO_OP_PREADV,
+  IO_OP_PWRITEV,
+  IO_OP_PREADV2,
+  IO_OP_PWRITEV2,
+  IO_OP_FSYNC,
+  IO_OP_FDATASYNC,
+  IO_OP_SENDFILE,
+  IO_OP_COPY_FILE_RANGE,
+  IO_OP_MMAP,
+  IO_OP_OPEN,
+  IO_OP_OPENAT,
+  IO_OP_CLOSE,
+  IO_OP_LSEEK,
+  IO_OP_COUNT,
+};
+
+static inline const char *io_op_name(uint32_t op) {
+  static const char *const names[IO_OP_COUNT] = {
+      "read",     "write",     "pread",    "pwrite",          "readv",
+      "writev",   "preadv",    "pwritev",  "preadv2",         "pwritev2",
+      "fsync",    "fdatasync", "sendfile", "copy_file_range", "mmap",
+      "open",     "openat",    "close",    "lseek",
+  };
+  return op < IO_OP_COUNT ? names[op] : "unknown";
+}
+
+struct io_trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t event_size;
+  // Units of the text log, as given in CSPM_IO
+  char size_unit;
+  char time_unit;
+  char reserved[6];
+};
+
+struct io_event {
+  // CLOCK_MONOTONIC
+  uint64_t start_ns;
+  uint64_t end_ns;
+  // Buffer, iovec array or mmap hint
+  uint64_t buf;
+  // Requested bytes, summed over the iovecs of vectored calls
+  uint64_t count;
+  // Returned bytes (the fd for open, the address for mmap), or -1
+  int64_t ret;
+  // File offset, explicit or tracked from the file position; -1 if
+  // unknown
+  int64_t offset;
+  // Source fd of sendfile and copy_file_range
+  int32_t fd;
+  uint32_t tid;
+  uint32_t op;
+  // Destination fd of sendfile and copy_file_range, or -1
+  int32_t fd2;
+};
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+
+// Decode a binary trace of libcspmio.so into the text format of the old
+// io.log trace section, or into CSV
+//
+// io_decode [-f text|csv] [-t s|m|u|n] [-o output] <trace file>
+
+static int by_start(const void *a, const void *b) {
+  const struct io_event *x = a, *y = b;
+  return x->start_ns < y->start_ns ? -1 : x->start_ns > y->start_ns;
+}
+
+static double time_fractor_of(char unit) {
+  switch (unit) {
+  case 'm':
+    return 1e3;
+  case 'u':
+    return 1e6;
+  case 'n':
+    return 1e9;
+  default:
+    return 1;
+  }
+}
+
+int main(int argc, char **argv) {
+  char *format = "text";
+  char *output_file_name = NULL;
+  char time_unit = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "f:t:o:")) != -1) {
+    switch (opt) {
+    case 'f':
+      format = optarg;
+      break;
+    case 't':
+      time_unit = optarg[0];
+      break;
+    case 'o':
+      output_file_name = optarg;
+      break;
+    default:
+      printf("Usage: %s [-f text|csv] [-t s|m|u|n] [-o output] <trace file>\n",
+             argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    printf("Usage: %s [-f text|csv] [-t s|m|u|n] [-o output] <trace file>\n",
+           argv[0]);
+    return 1;
+  }
+  int csv = strcmp(format, "csv") == 0;
+  if (!csv && strcmp(format, "text") != 0) {
+    printf("CSPM: [ERROR] Invalid format: %s\n", format);
+    return 1;
+  }
+
+  FILE *in = fopen(argv[optind], "rb");
+  if (!in) {
+    perror("CSPM: [ERROR] Cannot open trace file ");
+    return 1;
+  }
+  struct io_trace_header header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, IO_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+    printf("CSPM: [ERROR] %s is not a CSPM IO trace\n", argv[optind]);
+    return 1;
+  }
+  if (header.version != IO_TRACE_VERSION ||
+      header.event_size != sizeof(struct io_event)) {
+    printf("CSPM: [ERROR] Unsupported trace version %u\n", header.version);
+    return 1;
+  }
+
+  // Threads write their buffers in turns: sort back into time order
+  size_t count = 0, capacity = 1 << 16;
+  struct io_event *events = malloc(capacity * sizeof(struct io_event));
+  for (;;) {
+    if (count == capacity) {
+      capacity *= 2;
+      events = realloc(events, capacity * sizeof(struct io_event));
+    }
+    if (!events) {
+      printf("CSPM: [ERROR] Out of memory\n");
+      return 1;
+    }
+    size_t n = fread(events + count, sizeof(struct io_event), capacity - count,
+                     in);
+    if (n == 0) {
+      break;
+    }
+    count += n;
+  }
+  fclose(in);
+  qsort(events, count, sizeof(struct io_event), by_start);
+
+  FILE *out = stdout;
+  if (output_file_name) {
+    out = fopen(output_file_name, "w");
+    if (!out) {
+      perror("CSPM: [ERROR] Cannot open output file ");
+      return 1;
+    }
+  }
+
+  double time_fractor = time_fractor_of(time_unit ? time_unit
+                                                  : header.time_unit);
+  if (csv) {
+    fprintf(out, "tid,op,fd,fd2,buf,count,offset,ret,start_ns,end_ns,"
+                 "duration_ns\n");
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const struct io_event *e = &events[i];
+    if (csv) {
+      fprintf(out, "%u,%s,%d,%d,0x%lx,%lu,%ld,%ld,%lu,%lu,%lu\n", e->tid,
+              io_op_name(e->op), e->fd, e->fd2, e->buf, e->count, e->offset,
+              e->ret, e->start_ns, e->end_ns, e->end_ns - e->start_ns);
+    } else {
+      double start = e->start_ns / 1e9, end = e->end_ns / 1e9;
+      fprintf(out, "- %s (%d", io_op_name(e->op), e->fd);
+      if (e->fd2 >= 0) {
+        fprintf(out, " -> %d", e->fd2);
+      }
+      fprintf(out, ", %p, %lu", (void *)(uintptr_t)e->buf, e->count);
+      if (e->offset >= 0) {
+        fprintf(out, " @ %ld", e->offset);
+      }
+      fprintf(out, ") = %ld [%.4f](%f-%f)\n", e->ret,
+              (end - start) * time_fractor, start, end);
+    }
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  free(events);
+  return 0;
+}
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "io.h"
+
+// Checks of the access pattern analysis of libcspmio.so
+//
+// io_test <libcspmio.so>
+//
+// Runs itself with the library preloaded, then checks its io.log.
+
+static const char *log_file = "io_test.log";
+static const char *trace_file = "io_test.trace";
+static const char *data_file = "io_test.data";
+static const char *fork_file = "io_test.fork";
+
+// The traced workload
+static int child() {
+  char buf[4096] = {0};
+
+  // A pipe is never opened through open: its position must be asked
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("CSPM: [ERROR] pipe ");
+    return 1;
+  }
+  for (int i = 0; i < 50; ++i) {
+    write(fds[1], buf, 6);
+  }
+  close(fds[1]);
+  while (read(fds[0], buf, sizeof(buf)) > 0) {
+  }
+  close(fds[0]);
+
+  int fd = open(data_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  for (int i = 0; i < 16; ++i) {
+    write(fd, buf, sizeof(buf));
+  }
+  close(fd);
+
+  // Appends start at the end, not at 0
+  fd = open(data_file, O_WRONLY | O_APPEND);
+  write(fd, buf, 100);
+  close(fd);
+
+  // A forked child traces its own calls, and only those
+  fd = open(fork_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  write(fd, buf, 7);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    for (int i = 0; i < 3; ++i) {
+      write(fd, buf, 10);
+    }
+    exit(0);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
+
+static char *read_log() {
+  FILE *fp = fopen(log_file, "r");
+  if (!fp) {
+    return NULL;
+  }
+  static char text[1 << 20];
+  size_t n = fread(text, 1, sizeof(text) - 1, fp);
+  text[n] = 0;
+  fclose(fp);
+  return text;
+}
+
+// Offset of the last traced write of `count` bytes, or -2, and how many
+// writes of `count` bytes were traced
+static int64_t write_offset(uint64_t count, int *writes) {
+  FILE *fp = fopen(trace_file, "rb");
+  *writes = 0;
+  if (!fp) {
+    return -2;
+  }
+  struct io_trace_header header;
+  struct io_event event;
+  int64_t offset = -2;
+  if (fread(&header, sizeof(header), 1, fp) == 1) {
+    while (fread(&event, sizeof(event), 1, fp) == 1) {
+      if (event.op == IO_OP_WRITE && event.count == count) {
+        offset = event.offset;
+        ++*writes;
+      }
+    }
+  }
+  fclose(fp);
+  return offset;
+}
+
+// Whether the block of lines of `section` that starts with `prefix` has
+// a line starting with `line`
+static int block_has(const char *section, const char *prefix,
+                     const char *line) {
+  size_t length = strlen(line);
+  for (const char *at = section; at && *at;) {
+    if (strncmp(at, prefix, strlen(prefix)) == 0) {
+      for (at = strchr(at, '\n'); at && at[1] && at[1] != '\n';
+           at = strchr(at + 1, '\n')) {
+        if (strncmp(at + 1, line, length) == 0) {
+          return 1;
+        }
+      }
+      return 0;
+    }
+    at = strchr(at, '\n');
+    at = at ? at + 1 : NULL;
+  }
+  return 0;
+}
+
+static int check(int ok, const char *what) {
+  printf("CSPM: [%s] %s\n", ok ? "INFO" : "ERROR", what);
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "child") == 0) {
+    return child();
+  }
+  if (argc != 2) {
+    printf("Usage: %s <libcspmio.so>\n", argv[0]);
+    return 1;
+  }
+
+  char options[256];
+  snprintf(options, sizeof(options), "-o %s -b %s", log_file, trace_file);
+  pid_t pid = fork();
+  if (pid == 0) {
+    setenv("LD_PRELOAD", argv[1], 1);
+    setenv("CSPM_IO", options, 1);
+    execl("/proc/self/exe", argv[0], "child", (char *)NULL);
+    perror("CSPM: [ERROR] exec ");
+    _exit(1);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    printf("CSPM: [ERROR] The traced run failed\n");
+    return 1;
+  }
+
+  char *text = read_log();
+  // The forked child writes its summary first, under its own title
+  const char *summary = text ? strstr(text, "# SUMMARY\n") : NULL;
+  const char *forked = text ? strstr(text, "# SUMMARY of forked pid") : NULL;
+  const char *patterns =
+      summary ? strstr(summary, "## Access patterns") : NULL;
+  if (!patterns) {
+    printf("CSPM: [ERROR] No access patterns in %s\n", log_file);
+    return 1;
+  }
+
+  int failed = 0;
+  failed += check(
+      block_has(patterns, "pipe:[", "  write: not seekable, 50 accesses"),
+      "pipe writes are not seekable");
+
+  char *data_path = realpath(data_file, NULL);
+  failed += check(data_path && block_has(patterns, data_path,
+                                         "  write: sequential, 17 accesses"),
+                  "file writes are sequential");
+  free(data_path);
+  int writes;
+  failed += check(write_offset(100, &writes) == 16 * 4096,
+                  "the append is at the end of the file");
+
+  int parent_writes, child_writes;
+  write_offset(7, &parent_writes);
+  write_offset(10, &child_writes);
+  failed += check(parent_writes == 1 && child_writes == 3,
+                  "a forked child traces its own writes");
+  failed += check(forked && strstr(forked, "Count (R/W): 0 / 3\n") &&
+                      (!summary || strstr(forked, "Count (R/W):") <
+                                       summary),
+                  "a forked child counts only its own calls");
+
+  unlink(log_file);
+  unlink(trace_file);
+  unlink(data_file);
+  unlink(fork_file);
+  return failed ? 1 : 0;
+}
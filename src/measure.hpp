@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cpuid.h>
+#include <cstdio>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "timeit.hpp"
+#include "utils.hpp"
+
+// Shared measurement layer: TSC ticks converted to real time, repeated
+// samples after a warmup, and robust statistics over them, so numbers are
+// comparable across hosts with different TSC frequencies.
+
+inline auto monotonic_raw_ns() -> u64 {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+// The TSC frequency, calibrated once against CLOCK_MONOTONIC_RAW (which NTP
+// does not slew)
+class TscClock {
+public:
+  static auto get() -> const TscClock & {
+    static TscClock clock;
+    return clock;
+  }
+
+  auto ns(f64 ticks) const -> f64 { return ticks / ghz; }
+
+  auto ticks_per_ns() const -> f64 { return ghz; }
+
+  // Ticks at a constant rate in every P- and C-state
+  auto invariant() const -> bool { return is_invariant; }
+
+private:
+  TscClock() {
+    u32 a, b, c, d;
+    is_invariant = __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1 << 8));
+
+    // Median of five 10 ms windows
+    std::vector<f64> rates;
+    for (u32 i = 0; i < 5; ++i) {
+      u64 ns0 = 0, tsc0 = sample(ns0);
+      u64 ns1 = 0, tsc1;
+      do {
+        tsc1 = sample(ns1);
+      } while (ns1 - ns0 < 10000000);
+      rates.push_back((f64)(tsc1 - tsc0) / (ns1 - ns0));
+    }
+    std::sort(rates.begin(), rates.end());
+    ghz = rates[rates.size() / 2];
+  }
+
+  // A (clock, TSC) pair: the TSC read closest to the clock read of a few
+  // tries, which bounds the error of the pair by the time between reads
+  static auto sample(u64 &ns) -> u64 {
+    u64 best = UINT64_MAX, tsc = 0;
+    ns = 0;
+    for (u32 i = 0; i < 8; ++i) {
+      u64 before = tsc_begin();
+      u64 now = monotonic_raw_ns();
+      u64 after = tsc_end();
+      if (after - before < best) {
+        best = after - before;
+        tsc = before + (after - before) / 2;
+        ns = now;
+      }
+    }
+    return tsc;
+  }
+
+  f64 ghz;
+  bool is_invariant;
+};
+
+// Summary of a set of samples, in the unit of the samples. The confidence
+// interval is that of the median, from order statistics, so it needs no
+// assumption about the distribution; outliers lie beyond 1.5 IQR of the
+// quartiles (Tukey's fences).
+struct Stats {
+  u64 n;
+  f64 min;
+  f64 median;
+  f64 p99;
+  f64 mean;
+  f64 ci_low;
+  f64 ci_high;
+  u64 outliers;
+};
+
+// Percentile `p` (0..1) of sorted samples, interpolated
+inline auto percentile(const std::vector<f64> &sorted, f64 p) -> f64 {
+  f64 pos = p * (sorted.size() - 1);
+  size_t i = (size_t)pos;
+  if (i + 1 >= sorted.size()) {
+    return sorted.back();
+  }
+  return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+inline auto summarize(std::vector<f64> samples) -> Stats {
+  Stats stats = {samples.size(), 0, 0, 0, 0, 0, 0, 0};
+  if (samples.empty()) {
+    return stats;
+  }
+  std::sort(samples.begin(), samples.end());
+  u64 n = samples.size();
+  stats.min = samples.front();
+  stats.median = percentile(samples, 0.5);
+  stats.p99 = percentile(samples, 0.99);
+
+  f64 sum = 0;
+  for (f64 sample : samples) {
+    sum += sample;
+  }
+  stats.mean = sum / n;
+
+  // Ranks n/2 -+ 1.96 sqrt(n)/2 bound the median with 95% confidence
+  f64 half = 0.98 * std::sqrt((f64)n);
+  i64 lo = (i64)std::floor(n / 2.0 - half);
+  i64 hi = (i64)std::ceil(n / 2.0 + half);
+  stats.ci_low = samples[lo < 0 ? 0 : lo];
+  stats.ci_high = samples[hi >= (i64)n ? n - 1 : hi];
+
+  f64 q1 = percentile(samples, 0.25), q3 = percentile(samples, 0.75);
+  f64 fence = 1.5 * (q3 - q1);
+  for (f64 sample : samples) {
+    if (sample < q1 - fence || sample > q3 + fence) {
+      ++stats.outliers;
+    }
+  }
+  return stats;
+}
+
+struct MeasureConfig {
+  // Untimed runs first, to warm caches, TLBs and branch predictors
+  u32 warmup;
+  // Timed samples
+  u32 reps;
+  // Calls per sample, for calls too short to time one by one; 0 picks
+  // the smallest batch that takes 10 us
+  u64 batch;
+};
+
+// ns per call of `f`, one sample per batch of calls, less the overhead of
+// an empty batch
+template <typename F>
+inline auto measure(F &&f, const MeasureConfig &config) -> Stats {
+  const TscClock &clock = TscClock::get();
+  u64 batch = config.batch;
+  if (batch == 0) {
+    batch = calibrate_batch(f, (u64)(clock.ticks_per_ns() * 10000));
+  }
+  for (u32 i = 0; i < config.warmup; ++i) {
+    timeit_batch(f, batch);
+  }
+  u64 overhead = empty_loop_ticks(batch);
+  std::vector<f64> samples;
+  samples.reserve(config.reps);
+  for (u32 i = 0; i < config.reps; ++i) {
+    u64 ticks = timeit_batch(f, batch);
+    ticks = ticks > overhead ? ticks - overhead : 0;
+    samples.push_back(clock.ns(ticks) / batch);
+  }
+  return summarize(samples);
+}
+
+// "12.345 us" from ns, in the largest unit below the value
+inline auto format_ns(f64 ns) -> std::string {
+  const char *units[] = {"ns", "us", "ms", "s"};
+  u32 unit = 0;
+  while (unit < 3 && ns >= 1000) {
+    ns /= 1000;
+    ++unit;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3f %s", ns, units[unit]);
+  return buf;
+}
+
+inline auto print_stats(const char *name, const Stats &stats) -> void {
+  printf("%s: median %s (95%% CI %s - %s), min %s, p99 %s, %lu/%lu "
+         "outliers\n",
+         name, format_ns(stats.median).c_str(), format_ns(stats.ci_low).c_str(),
+         format_ns(stats.ci_high).c_str(), format_ns(stats.min).c_str(),
+         format_ns(stats.p99).c_str(), stats.outliers, stats.n);
+}
+
+// Benchmark `f` with a calibrated batch and print its time per call, e.g.
+//   bench("hash", [&]() { do_not_optimize(hash(key)); });
+template <typename F> inline auto bench(const char *name, F &&f) -> Stats {
+  Stats stats = measure(f, {3, 30, 0});
+  print_stats(name, stats);
+  return stats;
+}
+
+inline auto print_clock() -> void {
+  const TscClock &clock = TscClock::get();
+  printf("TSC: %.3f GHz%s\n", clock.ticks_per_ns(),
+         clock.invariant() ? "" : " (not invariant, times may be off)");
+}
@@ -1,136 +1,170 @@
+#include <csignal>
+#include <cstring>
 #include <map>
-#include <stack>
+#include <memory>
 #include <string>
-#include <sys/ptrace.h>
 #include <sys/time.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
 
 #include <cxxopts.hpp>
-#include <libunwind-ptrace.h>
-#include <libunwind-x86_64.h>
-#include <libunwind.h>
 
+#include <profile/diff.hpp>
+#include <profile/perf.hpp>
+#include <profile/report.hpp>
+#include <profile/scheduler.hpp>
+#include <profile/session.hpp>
+#include <profile/tree.hpp>
 #include <utils.hpp>
 
-// A Node of one symbol, used to build the symbol tree
-struct SymbolNode {
-  std::string name;
-  int count;
-  std::map<std::string, SymbolNode *> children;
-};
+// Set by SIGUSR1 to write a snapshot of the profile so far
+static volatile sig_atomic_t snapshot_requested = 0;
 
-auto print_symbol_tree(SymbolNode *node, u8 depth) -> void {
+auto request_snapshot(int) -> void { snapshot_requested = 1; }
+
+// `split` adds the on-CPU and off-CPU parts of every count
+auto print_symbol_tree(const std::string &name, const ReportNode *node,
+                       u8 depth, bool split = false) -> void {
   // Print the symbol tree in a DFS way
-  printf("%*d:%*c%s\n", 6, node->count, depth * 2, ' ', node->name.c_str());
+  if (split) {
+    printf("%*lu %*lu %*lu:%*c%s\n", 6, node->count, 6,
+           node->count - node->off_cpu, 6, node->off_cpu, depth * 2, ' ',
+           name.c_str());
+  } else {
+    printf("%*lu:%*c%s\n", 6, node->count, depth * 2, ' ', name.c_str());
+  }
   for (auto &pair : node->children) {
-    print_symbol_tree(pair.second, depth + 1);
+    print_symbol_tree(pair.first, pair.second.get(), depth + 1, split);
   }
 }
 
-auto sampling(pid_t target, SymbolNode *tree) -> void {
-  unw_addr_space_t as = unw_create_addr_space(&_UPT_accessors, 0);
-  if (!as) {
-    printf("CSPM: [ERROR] unw_create_addr_space failed\n");
-    exit(1);
+// All threads merged by name
+auto merge_report(const std::vector<ThreadProfile *> &threads,
+                  SamplingSession &session) -> std::unique_ptr<ReportNode> {
+  std::unique_ptr<ReportNode> merged(new ReportNode());
+  for (ThreadProfile *thread : threads) {
+    const SymbolNode *top = thread->tree->top();
+    merged->count += top->count;
+    merged->off_cpu += top->off_cpu;
+    build_report(top, merged.get(), session.names_of(thread->tgid));
   }
+  return merged;
+}
 
-  unw_context_t uc;
-  unw_getcontext(&uc);
+auto print_perf_counters(const PerfStats &stats, u32 interval,
+                         u64 elapsed_us) -> void {
+  printf("CSPM: samples: %lu (%lu lost)\n", stats.samples, stats.lost);
+  // The kernel samples per thread and only while it runs on a CPU
+  printf("CSPM: sample rate: requested %.1f Hz per running thread, "
+         "achieved %.1f Hz overall\n",
+         1e6 / interval, elapsed_us ? stats.samples * 1e6 / elapsed_us : 0.0);
+}
 
-  // Attach to the target
-  int res = ptrace(PTRACE_ATTACH, target, 0, 0);
-  if (res == -1) {
-    perror("CSPM: [ERROR] ptrace failed ");
-    exit(1);
+// One tree per thread if `per_thread`, followed by all threads merged.
+// `split` prints the on-CPU and off-CPU columns of wall-clock mode.
+auto print_report(std::vector<ThreadProfile *> &threads,
+                  SamplingSession &session, bool per_thread, bool split)
+    -> void {
+  std::unique_ptr<ReportNode> merged = merge_report(threads, session);
+  u64 nodes = 0;
+  u64 memory = 0;
+
+  for (ThreadProfile *thread : threads) {
+    const SymbolNode *top = thread->tree->top();
+    const NameTable &names = session.names_of(thread->tgid);
+    nodes += thread->tree->nodes();
+    memory += thread->tree->memory();
+
+    if (per_thread && top->count) {
+      ReportNode report;
+      report.count = top->count;
+      report.off_cpu = top->off_cpu;
+      build_report(top, &report, names);
+      char title[128];
+      snprintf(title, sizeof(title), "Thread %d (%s) of %d", thread->tid,
+               thread->comm.c_str(), thread->tgid);
+      print_symbol_tree(title, &report, 0, split);
+    }
   }
 
-  // Wait for the target to stop
-  int status;
-  waitpid(target, &status, 0);
-  if (!WIFSTOPPED(status)) {
-    printf("CSPM: [ERROR] target is not stopped\n");
-    if (WIFEXITED(status)) {
-      // printf("CSPM: child exit: %d\n", WEXITSTATUS(status));
-      return;
-    }
-    printf("CSPM: [ERROR] target is not exited either\n");
-  }
-
-  struct UPT_info *ui = (struct UPT_info *)_UPT_create(target);
-  if (!ui) {
-    printf("CSPM: [ERROR] _UPT_create failed\n");
-    exit(1);
-  }
-
-  // Init cursor
-  unw_cursor_t cursor;
-  res = unw_init_remote(&cursor, as, ui);
-  if (res != 0) {
-    printf("CSPM: [ERROR] unw_init_remote failed ");
-    switch (res) {
-    case UNW_EINVAL:
-      printf("(UNW_EINVAL)\n");
-      break;
-    case UNW_EUNSPEC:
-      printf("(UNW_EUNSPEC)\n");
-      break;
-    case UNW_EBADREG:
-      printf("(UNW_EBADREG)\n");
-      break;
-    default:
-      printf("(UNKNOWN %d)\n", res);
-      break;
+  printf("CSPM: call tree: %lu threads, %lu nodes, %lu KiB\n",
+         threads.size(), nodes, memory / 1024);
+  if (merged->count == 0) {
+    printf("CSPM: No symbol is profiled\n");
+  } else {
+    if (split) {
+      printf(" total on-cpu off-cpu\n");
     }
-    // exit(1);
+    print_symbol_tree("CSPM Symbol Tree", merged.get(), 0, split);
+  }
+}
+
+auto print_overhead(const SessionStats &stats, u64 elapsed_us) -> void {
+  if (stats.samples == 0) {
     return;
   }
+  printf("CSPM: samples: %lu (%lu failed, %lu dropped)\n", stats.samples,
+         stats.failed, stats.dropped);
+  printf("CSPM: overhead per sample: stop %.2f us, capture %.2f us, "
+         "unwind %.2f us, stopped %.2f us (max %.2f us)\n",
+         stats.stop_ns / 1e3 / stats.samples,
+         stats.capture_ns / 1e3 / stats.samples,
+         stats.unwind_ns / 1e3 / stats.samples,
+         stats.stopped_ns / 1e3 / stats.samples, stats.max_stopped_ns / 1e3);
+  printf("CSPM: target stopped for %lu us (%.2f%% of elapsed)\n",
+         stats.stopped_ns / 1000,
+         elapsed_us ? stats.stopped_ns / 10.0 / elapsed_us : 0.0);
+  if (stats.off_cpu) {
+    printf("CSPM: off-cpu samples: %lu (%.2f%%)\n", stats.off_cpu,
+           stats.off_cpu * 100.0 / stats.samples);
+  }
+}
 
-  // Get full backtrace, save symbol to the tree
-  std::stack<std::string> symbol_stack;
+// Compare two folded profiles instead of profiling a command
+auto run_diff(const std::vector<std::string> &paths, const std::string &output,
+              size_t top) -> int {
+  if (paths.size() != 2) {
+    printf("CSPM: [ERROR] --diff needs two profiles: base,new\n");
+    return 1;
+  }
+  ReportNode base, next;
+  if (!read_folded(paths[0], base) || !read_folded(paths[1], next)) {
+    return 1;
+  }
 
-  do {
-    unw_word_t offset;
-    char name[256] = {0};
+  std::vector<PathDelta> deltas = diff_reports(base, next);
+  printf("===== CSPM Profile Diff =====\n");
+  print_diff(deltas, base.count, next.count, top);
 
-    res = unw_get_proc_name(&cursor, name, sizeof(name), &offset);
-    if (res == 0) {
-      // Get proc name success
-      symbol_stack.push(std::string(name));
+  if (!output.empty()) {
+    FILE *fp = fopen(output.c_str(), "w");
+    if (!fp) {
+      perror("CSPM: [ERROR] Cannot open profile output ");
+      return 1;
     }
-    // TODO: handle error
-  } while (unw_step(&cursor) > 0);
-
-  SymbolNode *current = tree;
-  current->count++;
-
-  while (!symbol_stack.empty()) {
-    std::string symbol = symbol_stack.top();
-    symbol_stack.pop();
-
-    if (current->children.count(symbol) == 0) {
-      // Create new node
-      SymbolNode *new_node = new SymbolNode();
-      new_node->name = symbol;
-      new_node->count = 0;
-      current->children[symbol] = new_node;
-    }
-    current = current->children[symbol];
-    current->count++;
+    write_folded_diff(fp, deltas, base.count);
+    fclose(fp);
+    printf("CSPM: diff written to %s\n", output.c_str());
   }
-
-  _UPT_destroy(ui);
-
-  ptrace(PTRACE_DETACH, target, 0, 0);
-
-  unw_destroy_addr_space(as);
+  return 0;
 }
 
 auto main(int argc, char **argv) -> int {
   cxxopts::Options options("profile", "Profiling a command");
 
   u32 interval;
+  std::string backend;
+  std::string perf_event;
+  std::string unwinder_name;
+  u64 stack_size;
+  u32 jobs;
+  bool per_thread;
+  bool wall_clock;
+  std::string output;
+  std::string format;
+  u32 snapshot_interval;
+  std::vector<std::string> diff;
+  u32 top;
   std::vector<std::string> cmds;
 
   // clang-format off
@@ -138,6 +172,30 @@ auto main(int argc, char **argv) -> int {
     ("h,help", "Print help")
     ("i,interval", "Interval to update profile (us) (default: 1000)",
     cxxopts::value(interval)->default_value("1000"))
+    ("b,backend", "Sampling backend (ptrace, perf) (default: ptrace)",
+    cxxopts::value(backend)->default_value("ptrace"))
+    ("e,event", "Software event of the perf backend (cpu-clock, task-clock) (default: cpu-clock)",
+    cxxopts::value(perf_event)->default_value("cpu-clock"))
+    ("u,unwinder", "Unwinder of the ptrace backend (remote, snapshot, fp) (default: remote)",
+    cxxopts::value(unwinder_name)->default_value("remote"))
+    ("stack-size", "Bytes of stack copied per sample by the snapshot and fp unwinders (default: 65536)",
+    cxxopts::value(stack_size)->default_value("65536"))
+    ("j,jobs", "Unwinder threads of the snapshot and fp unwinders (default: 1)",
+    cxxopts::value(jobs)->default_value("1"))
+    ("per-thread", "Print the tree of every thread before the merged one",
+    cxxopts::value(per_thread)->default_value("false"))
+    ("w,wall", "Wall-clock mode of the ptrace backend: split counts into on-CPU and off-CPU by thread state",
+    cxxopts::value(wall_clock)->default_value("false"))
+    ("o,output", "Also write the profile to this file; SIGUSR1 writes a snapshot to <file>.<n>",
+    cxxopts::value(output)->default_value(""))
+    ("f,format", "Format of the output file (folded, pprof) (default: folded)",
+    cxxopts::value(format)->default_value("folded"))
+    ("snapshot-interval", "Write a snapshot every this many seconds, needs --output (default: 0, off)",
+    cxxopts::value(snapshot_interval)->default_value("0"))
+    ("diff", "Compare two folded profiles (base,new) instead of running a command; --output gets two-column folded stacks",
+    cxxopts::value(diff))
+    ("top", "Call paths shown by --diff (default: 30)",
+    cxxopts::value(top)->default_value("30"))
     ("cmds", "command to run",
     cxxopts::value<std::vector<std::string>>(cmds))
   ;
@@ -147,15 +205,48 @@ auto main(int argc, char **argv) -> int {
 
   auto result = options.parse(argc, argv);
 
-  if (result["help"].as<bool>() || !result.count("cmds")) {
+  if (result["help"].as<bool>() ||
+      (!result.count("cmds") && !result.count("diff"))) {
     printf("%s\n", options.help().c_str());
     return 0;
   }
 
-  // std::map<std::string, int> symbol_count;
-  SymbolNode *symbol_tree = new SymbolNode();
-  symbol_tree->name = "CSPM Symbol Tree";
-  symbol_tree->count = 0;
+  if (result.count("diff")) {
+    return run_diff(diff, output, top);
+  }
+
+  if (backend != "ptrace" && backend != "perf") {
+    printf("CSPM: [ERROR] Unknown backend: %s\n", backend.c_str());
+    return 1;
+  }
+
+  if (wall_clock && backend != "ptrace") {
+    // perf only samples threads while they run
+    printf("CSPM: [ERROR] Wall-clock mode needs the ptrace backend\n");
+    return 1;
+  }
+
+  OutputFormat output_format;
+  if (format == "folded") {
+    output_format = OutputFormat::Folded;
+  } else if (format == "pprof") {
+    output_format = OutputFormat::Pprof;
+  } else {
+    printf("CSPM: [ERROR] Unknown output format: %s\n", format.c_str());
+    return 1;
+  }
+
+  Unwinder unwinder;
+  if (unwinder_name == "remote") {
+    unwinder = Unwinder::Remote;
+  } else if (unwinder_name == "snapshot") {
+    unwinder = Unwinder::Snapshot;
+  } else if (unwinder_name == "fp") {
+    unwinder = Unwinder::FramePointer;
+  } else {
+    printf("CSPM: [ERROR] Unknown unwinder: %s\n", unwinder_name.c_str());
+    return 1;
+  }
 
   struct timeval start, end;
 
@@ -180,34 +271,123 @@ auto main(int argc, char **argv) -> int {
     // sleep for a while to wait for child to start
     usleep(100000);
 
-    while (true) {
-      // Test if child exited
-      int status;
-      int wait_res = waitpid(target, &status, WNOHANG);
-      if (wait_res == -1) {
-        perror("CSPM: [ERROR] waitpid failed ");
-        exit(1);
+    SamplingSession session(target, unwinder, stack_size, jobs, wall_clock);
+    SampleClock clock((u64)interval * 1000);
+
+    u64 start_ns = (u64)start.tv_sec * 1000000000 + (u64)start.tv_usec * 1000;
+    ProfileWriter writer(output_format, {(u64)interval * 1000, wall_clock,
+                                         start_ns, 0});
+    u64 snapshots = 0;
+    u64 started = monotonic_ns();
+    u64 next_snapshot = started + (u64)snapshot_interval * 1000000000;
+    if (!output.empty()) {
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = request_snapshot;
+      sa.sa_flags = SA_RESTART;
+      sigaction(SIGUSR1, &sa, nullptr);
+    }
+    // Write the profile so far while the target keeps running; the sampler
+    // only waits for the report to be copied out of the trees
+    auto snapshot = [&]() {
+      u64 now = monotonic_ns();
+      bool due = snapshot_interval && now >= next_snapshot;
+      if (output.empty() || (!snapshot_requested && !due)) {
+        return;
+      }
+      snapshot_requested = 0;
+      if (due) {
+        next_snapshot = now + (u64)snapshot_interval * 1000000000;
       }
-      if (WIFEXITED(status)) {
-        // child process exited
-
-        gettimeofday(&end, NULL);
-        printf("===== CSPM Profile =====\n");
-        printf("CSPM: child exit: %d\n", WEXITSTATUS(status));
-        printf("CSPM: time elapsed: %ld us\n",
-               (end.tv_sec - start.tv_sec) * 1000000 +
-                   (end.tv_usec - start.tv_usec));
-        if (symbol_tree->count == 0) {
-          printf("CSPM: No symbol is profiled\n");
-        } else {
-          print_symbol_tree(symbol_tree, 0);
+      session.resolve_live();
+      std::vector<ThreadProfile *> threads;
+      session.collect(threads);
+      writer.write(merge_report(threads, session),
+                   output + "." + std::to_string(++snapshots), now - started);
+    };
+
+    // The perf backend needs one event per thread, opened as they show up
+    std::map<pid_t, std::unique_ptr<PerfSampler>> samplers;
+    PerfStats perf_stats;
+    auto collect = [&](pid_t tid, const u64 *ips, u64 n) {
+      session.insert(tid, ips, n);
+    };
+    auto drop_sampler = [&](pid_t tid) {
+      auto it = samplers.find(tid);
+      if (it == samplers.end()) {
+        return;
+      }
+      it->second->drain(collect);
+      perf_stats.samples += it->second->counters().samples;
+      perf_stats.lost += it->second->counters().lost;
+      samplers.erase(it);
+    };
+
+    if (backend == "perf") {
+      session.on_task = [&](pid_t tid) {
+        std::unique_ptr<PerfSampler> sampler(new PerfSampler());
+        if (sampler->open(tid, perf_event, (u64)interval * 1000)) {
+          samplers[tid] = std::move(sampler);
+        }
+      };
+      // Samples must be in the tree before the exiting thread's process is
+      // symbolized
+      session.on_exit = [&](pid_t tid) {
+        drop_sampler(tid);
+        for (auto &pair : samplers) {
+          pair.second->drain(collect);
         }
-        exit(0);
+      };
+    }
+
+    if (!session.attach()) {
+      exit(1);
+    }
+
+    if (backend == "perf") {
+      while (session.poll()) {
+        wait_any(samplers, 100);
+        for (auto &pair : samplers) {
+          pair.second->drain(collect);
+        }
+        snapshot();
+      }
+      while (!samplers.empty()) {
+        drop_sampler(samplers.begin()->first);
       }
+    } else {
+      clock.start();
+      while (session.poll()) {
+        session.sample();
+        snapshot();
 
-      sampling(target, symbol_tree);
+        clock.wait();
+      }
+    }
+
+    // child process exited
+    gettimeofday(&end, NULL);
+    u64 elapsed = (end.tv_sec - start.tv_sec) * 1000000 +
+                  (end.tv_usec - start.tv_usec);
+    printf("===== CSPM Profile =====\n");
+    printf("CSPM: child exit: %d\n", session.exit_status());
+    printf("CSPM: time elapsed: %lu us\n", elapsed);
+    if (backend == "perf") {
+      print_perf_counters(perf_stats, interval, elapsed);
+    } else {
+      print_overhead(session.overhead(), elapsed);
+      clock.report();
+    }
 
-      usleep(interval);
+    std::vector<ThreadProfile *> threads;
+    session.collect(threads);
+    print_report(threads, session, per_thread, wall_clock);
+    if (!output.empty()) {
+      writer.write(merge_report(threads, session), output, elapsed * 1000);
+      writer.wait();
+      printf("CSPM: profile written to %s (%lu snapshots)\n", output.c_str(),
+             snapshots);
     }
+    return 0;
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <unistd.h>
+#include <vector>
+
+#include <libunwind-ptrace.h>
+#include <libunwind-x86_64.h>
+#include <libunwind.h>
+
+#include <utils.hpp>
+
+// Registers and the top of the stack of a stopped thread, copied out so the
+// unwind can run after the thread has been continued
+struct StackSnapshot {
+  struct user_regs_struct regs;
+  // Remote address of data[0], the stack pointer at capture time
+  u64 base = 0;
+  // Bytes of data that could be read
+  u64 len = 0;
+  std::vector<u8> data;
+
+  auto contains(u64 addr, u64 size) const -> bool {
+    return addr >= base && addr + size <= base + len;
+  }
+
+  auto read(u64 addr) const -> u64 {
+    u64 val;
+    memcpy(&val, data.data() + (addr - base), sizeof(val));
+    return val;
+  }
+};
+
+// Copy up to `max_bytes` of stack from `tid`, which must be ptrace-stopped.
+// One PTRACE_GETREGS and one process_vm_readv instead of a PTRACE_PEEKDATA
+// per word.
+inline auto capture_stack(pid_t tid, u64 max_bytes, StackSnapshot &snap)
+    -> bool {
+  if (ptrace(PTRACE_GETREGS, tid, 0, &snap.regs) == -1) {
+    return false;
+  }
+
+  snap.base = snap.regs.rsp;
+  snap.len = 0;
+  snap.data.resize(max_bytes);
+
+  // One remote iovec per page: the read stops at the first unmapped page
+  // (the end of the stack) instead of failing as a whole
+  const u64 page = 4096;
+  struct iovec local = {snap.data.data(), max_bytes};
+  struct iovec remote[IOV_MAX];
+  int n = 0;
+  for (u64 addr = snap.base, end = snap.base + max_bytes;
+       addr < end && n < IOV_MAX; ++n) {
+    u64 next = (addr & ~(page - 1)) + page;
+    next = next < end ? next : end;
+    remote[n].iov_base = (void *)addr;
+    remote[n].iov_len = next - addr;
+    addr = next;
+  }
+
+  ssize_t res = process_vm_readv(tid, &local, 1, remote, n, 0);
+  if (res <= 0) {
+    return false;
+  }
+  snap.len = res;
+  return true;
+}
+
+// Walk the rbp chain of a binary built with -fno-omit-frame-pointer.
+// `frames` is leaf first, caller frames point into the call instruction.
+inline auto unwind_frame_pointers(const StackSnapshot &snap,
+                                  std::vector<u64> &frames,
+                                  size_t max_depth = 1024) -> bool {
+  frames.push_back(snap.regs.rip);
+
+  u64 fp = snap.regs.rbp;
+  while (frames.size() < max_depth && fp % 8 == 0 &&
+         snap.contains(fp, 2 * sizeof(u64))) {
+    u64 next = snap.read(fp);
+    u64 ret = snap.read(fp + sizeof(u64));
+    if (ret == 0) {
+      break;
+    }
+    frames.push_back(ret - 1);
+    // The stack grows down, callers' frames are at higher addresses
+    if (next <= fp) {
+      break;
+    }
+    fp = next;
+  }
+  return true;
+}
+
+// libunwind over a StackSnapshot: registers and stack come from the
+// snapshot, unwind tables are found through _UPT as usual, and memory
+// outside the snapshot is read with process_vm_readv, so the target does
+// not have to stay stopped.
+class SnapshotUnwinder {
+public:
+  explicit SnapshotUnwinder(pid_t target) : target(target) {}
+
+  SnapshotUnwinder(const SnapshotUnwinder &) = delete;
+  SnapshotUnwinder &operator=(const SnapshotUnwinder &) = delete;
+
+  ~SnapshotUnwinder() {
+    if (ui) {
+      _UPT_destroy(ui);
+    }
+    if (as) {
+      unw_destroy_addr_space(as);
+    }
+  }
+
+  auto init() -> bool {
+    accessors = _UPT_accessors;
+    accessors.access_mem = access_mem;
+    accessors.access_reg = access_reg;
+    accessors.access_fpreg = access_fpreg;
+    accessors.resume = nullptr;
+
+    as = unw_create_addr_space(&accessors, 0);
+    if (!as) {
+      printf("CSPM: [ERROR] unw_create_addr_space failed\n");
+      return false;
+    }
+    unw_set_caching_policy(as, UNW_CACHE_GLOBAL);
+
+    ui = _UPT_create(target);
+    if (!ui) {
+      printf("CSPM: [ERROR] _UPT_create failed\n");
+      return false;
+    }
+    return true;
+  }
+
+  auto unwind(const StackSnapshot &snap, std::vector<u64> &frames) -> bool {
+    Context ctx = {target, &snap};
+    current = &ctx;
+
+    // The _UPT callbacks get `ui` as their argument, ours use `current`
+    unw_cursor_t cursor;
+    bool ok = unw_init_remote(&cursor, as, ui) == 0;
+    if (ok) {
+      do {
+        unw_word_t ip;
+        if (unw_get_reg(&cursor, UNW_REG_IP, &ip) != 0 || ip == 0) {
+          break;
+        }
+        frames.push_back(frames.empty() ? ip : ip - 1);
+      } while (unw_step(&cursor) > 0);
+    }
+
+    current = nullptr;
+    return ok;
+  }
+
+private:
+  struct Context {
+    pid_t target;
+    const StackSnapshot *snap;
+  };
+
+  pid_t target;
+  unw_accessors_t accessors;
+  unw_addr_space_t as = nullptr;
+  void *ui = nullptr;
+
+  static inline thread_local const Context *current = nullptr;
+
+  static auto access_mem(unw_addr_space_t, unw_word_t addr, unw_word_t *val,
+                         int write, void *) -> int {
+    if (write || !current) {
+      return -UNW_EINVAL;
+    }
+    const StackSnapshot *snap = current->snap;
+    if (snap->contains(addr, sizeof(u64))) {
+      *val = snap->read(addr);
+      return 0;
+    }
+
+    struct iovec local = {val, sizeof(*val)};
+    struct iovec remote = {(void *)addr, sizeof(*val)};
+    if (process_vm_readv(current->target, &local, 1, &remote, 1, 0) !=
+        sizeof(*val)) {
+      return -UNW_EINVAL;
+    }
+    return 0;
+  }
+
+  static auto access_reg(unw_addr_space_t, unw_regnum_t reg, unw_word_t *val,
+                         int write, void *) -> int {
+    if (write || !current) {
+      return -UNW_EREADONLYREG;
+    }
+    // Indexed by UNW_X86_64_* up to UNW_X86_64_RIP
+    static const size_t offsets[] = {
+        offsetof(struct user_regs_struct, rax),
+        offsetof(struct user_regs_struct, rdx),
+        offsetof(struct user_regs_struct, rcx),
+        offsetof(struct user_regs_struct, rbx),
+        offsetof(struct user_regs_struct, rsi),
+        offsetof(struct user_regs_struct, rdi),
+        offsetof(struct user_regs_struct, rbp),
+        offsetof(struct user_regs_struct, rsp),
+        offsetof(struct user_regs_struct, r8),
+        offsetof(struct user_regs_struct, r9),
+        offsetof(struct user_regs_struct, r10),
+        offsetof(struct user_regs_struct, r11),
+        offsetof(struct user_regs_struct, r12),
+        offsetof(struct user_regs_struct, r13),
+        offsetof(struct user_regs_struct, r14),
+        offsetof(struct user_regs_struct, r15),
+        offsetof(struct user_regs_struct, rip),
+    };
+    if (reg < 0 || reg > UNW_X86_64_RIP) {
+      return -UNW_EBADREG;
+    }
+    memcpy(val, (const u8 *)&current->snap->regs + offsets[reg], sizeof(*val));
+    return 0;
+  }
+
+  static auto access_fpreg(unw_addr_space_t, unw_regnum_t, unw_fpreg_t *, int,
+                           void *) -> int {
+    return -UNW_EBADREG;
+  }
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <profile/report.hpp>
+#include <utils.hpp>
+
+// Read collapsed stacks as written by write_folded() back into a report
+inline auto read_folded(const std::string &path, ReportNode &root) -> bool {
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) {
+    perror("CSPM: [ERROR] Cannot open profile ");
+    return false;
+  }
+
+  std::string line;
+  char buf[4096];
+  while (fgets(buf, sizeof(buf), fp)) {
+    line += buf;
+    if (line.back() != '\n' && !feof(fp)) {
+      continue;
+    }
+    line.erase(line.find_last_not_of("\r\n") + 1);
+
+    // "a;b;c N", names may contain spaces but not the last one
+    size_t space = line.rfind(' ');
+    if (space != std::string::npos && space > 0) {
+      u64 count = strtoull(line.c_str() + space + 1, nullptr, 10);
+      ReportNode *node = &root;
+      root.count += count;
+      size_t begin = 0;
+      while (begin < space) {
+        size_t end = line.find(';', begin);
+        if (end == std::string::npos || end > space) {
+          end = space;
+        }
+        auto &slot = node->children[line.substr(begin, end - begin)];
+        if (!slot) {
+          slot.reset(new ReportNode());
+        }
+        node = slot.get();
+        node->count += count;
+        begin = end + 1;
+      }
+    }
+    line.clear();
+  }
+  fclose(fp);
+  return true;
+}
+
+// One call path present in either profile. Shares are fractions of the
+// total samples of their own profile, so runs of different length compare.
+struct PathDelta {
+  std::string path;
+  f64 base_self;
+  f64 new_self;
+  f64 base_total;
+  f64 new_total;
+
+  auto self_delta() const -> f64 { return new_self - base_self; }
+  auto total_delta() const -> f64 { return new_total - base_total; }
+};
+
+// Every path of the union of both trees, most changed self share first
+inline auto diff_reports(const ReportNode &base, const ReportNode &next)
+    -> std::vector<PathDelta> {
+  std::vector<PathDelta> res;
+  f64 base_sum = base.count ? base.count : 1;
+  f64 next_sum = next.count ? next.count : 1;
+
+  std::string path;
+  auto walk = [&](const ReportNode *a, const ReportNode *b,
+                  auto &&walk) -> void {
+    if (!path.empty()) {
+      res.push_back({path, a ? a->self() / base_sum : 0.0,
+                     b ? b->self() / next_sum : 0.0,
+                     a ? a->count / base_sum : 0.0,
+                     b ? b->count / next_sum : 0.0});
+    }
+
+    // Children of both sides, matched by name
+    std::vector<std::string> names;
+    if (a) {
+      for (auto &pair : a->children) {
+        names.push_back(pair.first);
+      }
+    }
+    if (b) {
+      for (auto &pair : b->children) {
+        if (!a || !a->children.count(pair.first)) {
+          names.push_back(pair.first);
+        }
+      }
+    }
+    for (const std::string &name : names) {
+      const ReportNode *ca = nullptr, *cb = nullptr;
+      if (a) {
+        auto it = a->children.find(name);
+        ca = it != a->children.end() ? it->second.get() : nullptr;
+      }
+      if (b) {
+        auto it = b->children.find(name);
+        cb = it != b->children.end() ? it->second.get() : nullptr;
+      }
+      size_t len = path.size();
+      if (len) {
+        path += ';';
+      }
+      path += name;
+      walk(ca, cb, walk);
+      path.resize(len);
+    }
+  };
+  walk(&base, &next, walk);
+
+  std::sort(res.begin(), res.end(), [](const PathDelta &x, const PathDelta &y) {
+    f64 dx = fabs(x.self_delta()), dy = fabs(y.self_delta());
+    if (dx != dy) {
+      return dx > dy;
+    }
+    return fabs(x.total_delta()) > fabs(y.total_delta());
+  });
+  return res;
+}
+
+// Top `limit` paths by impact, shares in percent
+inline auto print_diff(const std::vector<PathDelta> &deltas, u64 base_count,
+                       u64 new_count, size_t limit) -> void {
+  printf("CSPM: base %lu samples, new %lu samples\n", base_count, new_count);
+  printf("%26s %26s\n", "---------- self ----------",
+         "---------- total ---------");
+  printf("%8s %8s %8s %8s %8s %8s  %s\n", "base", "new", "delta", "base",
+         "new", "delta", "path");
+  for (size_t i = 0; i < deltas.size() && i < limit; ++i) {
+    const PathDelta &d = deltas[i];
+    if (d.self_delta() == 0 && d.total_delta() == 0) {
+      break;
+    }
+    printf("%7.2f%% %7.2f%% %+7.2f%% %7.2f%% %7.2f%% %+7.2f%%  %s\n",
+           d.base_self * 100, d.new_self * 100, d.self_delta() * 100,
+           d.base_total * 100, d.new_total * 100, d.total_delta() * 100,
+           d.path.c_str());
+  }
+}
+
+// Two-column collapsed stacks ("a;b;c BASE NEW") for differential flame
+// graphs (flamegraph.pl), with the new counts scaled to the base total
+inline auto write_folded_diff(FILE *fp, const std::vector<PathDelta> &deltas,
+                              u64 base_count) -> void {
+  for (const PathDelta &d : deltas) {
+    u64 base_self = llround(d.base_self * base_count);
+    u64 new_self = llround(d.new_self * base_count);
+    if (base_self || new_self) {
+      fprintf(fp, "%s %lu %lu\n", d.path.c_str(), base_self, new_self);
+    }
+  }
+}
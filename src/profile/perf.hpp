@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include <utils.hpp>
+
+// Counters of the perf backend, reported at exit
+struct PerfStats {
+  u64 samples = 0;
+  u64 lost = 0;
+};
+
+// Sampling through a software perf event on one thread of the target.
+//
+// The kernel takes PERF_SAMPLE_IP | PERF_SAMPLE_CALLCHAIN samples on every
+// tick of cpu-clock / task-clock and writes them into an mmap'd ring buffer,
+// so the target never has to be stopped. Software clocks work on VMs without
+// a hardware PMU.
+class PerfSampler {
+public:
+  PerfSampler() = default;
+
+  PerfSampler(const PerfSampler &) = delete;
+  PerfSampler &operator=(const PerfSampler &) = delete;
+
+  ~PerfSampler() {
+    if (base != MAP_FAILED) {
+      munmap(base, (data_pages + 1) * page_size);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  // `event` is "cpu-clock" or "task-clock", `period_ns` the sampling period.
+  // `data_pages` must be a power of two.
+  auto open(pid_t target, const std::string &event, u64 period_ns,
+            u32 data_pages = 64) -> bool {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    if (event == "cpu-clock") {
+      attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    } else if (event == "task-clock") {
+      attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    } else {
+      printf("CSPM: [ERROR] Unknown perf event: %s\n", event.c_str());
+      return false;
+    }
+    attr.sample_period = period_ns;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.disabled = 1;
+    // The kernel refuses to mmap inherited per-task events, every thread
+    // gets its own sampler instead
+    attr.inherit = 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.exclude_callchain_kernel = 1;
+    attr.watermark = 1;
+    attr.wakeup_watermark = data_pages * page_size / 4;
+
+    fd = syscall(SYS_perf_event_open, &attr, target, -1, -1, 0);
+    if (fd == -1) {
+      perror("CSPM: [ERROR] perf_event_open failed ");
+      return false;
+    }
+
+    this->data_pages = data_pages;
+    base = mmap(nullptr, (data_pages + 1) * page_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+      perror("CSPM: [ERROR] perf mmap failed ");
+      return false;
+    }
+
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+  }
+
+  auto descriptor() const -> int { return fd; }
+
+  // Hand every pending callchain (leaf first) to
+  // `f(pid_t tid, const u64 *ips, u64 n)`.
+  // Caller frames point into the call instruction.
+  template <typename F> auto drain(F &&f) -> void {
+    auto *meta = (struct perf_event_mmap_page *)base;
+    u8 *data = (u8 *)base + page_size;
+    u64 size = data_pages * page_size;
+
+    u64 head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+    u64 tail = meta->data_tail;
+
+    while (tail < head) {
+      struct perf_event_header header;
+      copy_out(data, size, tail, &header, sizeof(header));
+
+      if (header.type == PERF_RECORD_SAMPLE) {
+        record.resize(header.size);
+        copy_out(data, size, tail, record.data(), header.size);
+        parse_sample(record.data() + sizeof(header), f);
+      } else if (header.type == PERF_RECORD_LOST) {
+        u64 lost[2];
+        copy_out(data, size, tail + sizeof(header), lost, sizeof(lost));
+        stats.lost += lost[1];
+      }
+      tail += header.size;
+    }
+
+    __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+  }
+
+  auto counters() const -> const PerfStats & { return stats; }
+
+private:
+  int fd = -1;
+  void *base = MAP_FAILED;
+  u32 data_pages = 0;
+  u64 page_size = sysconf(_SC_PAGESIZE);
+  PerfStats stats;
+  std::vector<u8> record;
+  std::vector<u64> ips;
+
+  // Copy `len` bytes at ring offset `pos`, handling the wrap around
+  static auto copy_out(const u8 *data, u64 size, u64 pos, void *dst, u64 len)
+      -> void {
+    u64 off = pos & (size - 1);
+    u64 first = len < size - off ? len : size - off;
+    memcpy(dst, data + off, first);
+    memcpy((u8 *)dst + first, data, len - first);
+  }
+
+  template <typename F> auto parse_sample(const u8 *p, F &&f) -> void {
+    // PERF_SAMPLE_IP, PERF_SAMPLE_TID, PERF_SAMPLE_CALLCHAIN in this order
+    p += sizeof(u64); // ip, also the first callchain entry
+    u32 tid;
+    memcpy(&tid, p + sizeof(u32), sizeof(tid));
+    p += sizeof(u32) * 2; // pid, tid
+    u64 nr;
+    memcpy(&nr, p, sizeof(nr));
+    p += sizeof(nr);
+
+    ips.clear();
+    for (u64 i = 0; i < nr; ++i) {
+      u64 ip;
+      memcpy(&ip, p + i * sizeof(u64), sizeof(ip));
+      // Skip PERF_CONTEXT_* markers
+      if (ip >= (u64)PERF_CONTEXT_MAX) {
+        continue;
+      }
+      // Caller frames hold return addresses, point them at the call
+      ips.push_back(ips.empty() ? ip : ip - 1);
+    }
+
+    stats.samples++;
+    if (!ips.empty()) {
+      f((pid_t)tid, ips.data(), (u64)ips.size());
+    }
+  }
+};
+
+// Wait up to `timeout_ms` for any of the buffers to fill past the watermark
+template <typename Samplers>
+auto wait_any(const Samplers &samplers, int timeout_ms) -> void {
+  std::vector<struct pollfd> fds;
+  for (auto &pair : samplers) {
+    fds.push_back({pair.second->descriptor(), POLLIN, 0});
+  }
+  if (fds.empty()) {
+    usleep(timeout_ms * 1000);
+    return;
+  }
+  poll(fds.data(), fds.size(), timeout_ms);
+}
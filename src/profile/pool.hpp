@@ -0,0 +1,201 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <profile/capture.hpp>
+#include <profile/tree.hpp>
+#include <timeit.hpp>
+#include <utils.hpp>
+
+// Unwinds captured stacks off the ptrace thread.
+//
+// Snapshots are routed to a worker by tid, so every worker owns the trees of
+// its threads and nothing on the sample path is shared between workers.
+class UnwindPool {
+public:
+  // `frame_pointers` selects the rbp walker instead of libunwind
+  UnwindPool(bool frame_pointers, u32 jobs) : frame_pointers(frame_pointers) {
+    for (u32 i = 0; i < (jobs ? jobs : 1); ++i) {
+      workers.emplace_back(new Worker());
+    }
+    // Bound the memory held by queued snapshots
+    for (u32 i = 0; i < 64 * workers.size(); ++i) {
+      snapshots.emplace_back(new StackSnapshot());
+      free_list.push_back(snapshots.back().get());
+    }
+    for (auto &worker : workers) {
+      Worker *w = worker.get();
+      w->thread = std::thread([this, w]() { run(w); });
+    }
+  }
+
+  UnwindPool(const UnwindPool &) = delete;
+  UnwindPool &operator=(const UnwindPool &) = delete;
+
+  ~UnwindPool() {
+    for (auto &worker : workers) {
+      std::lock_guard<std::mutex> guard(worker->lock);
+      worker->stopping = true;
+      worker->wake.notify_one();
+    }
+    for (auto &worker : workers) {
+      worker->thread.join();
+    }
+  }
+
+  // A free snapshot buffer, nullptr if all of them are queued
+  auto acquire() -> StackSnapshot * {
+    std::lock_guard<std::mutex> guard(free_lock);
+    if (free_list.empty()) {
+      return nullptr;
+    }
+    StackSnapshot *snap = free_list.back();
+    free_list.pop_back();
+    return snap;
+  }
+
+  auto release(StackSnapshot *snap) -> void {
+    std::lock_guard<std::mutex> guard(free_lock);
+    free_list.push_back(snap);
+  }
+
+  // A non-zero `state_frame` marks an off-CPU sample, see StateFrames
+  auto submit(pid_t tid, pid_t tgid, StackSnapshot *snap, u64 state_frame = 0)
+      -> void {
+    Worker *w = workers[tid % workers.size()].get();
+    std::lock_guard<std::mutex> guard(w->lock);
+    w->queue.push_back({tid, tgid, snap, state_frame});
+    w->wake.notify_one();
+  }
+
+  // Wait until every queued snapshot is in a tree
+  auto flush() -> void {
+    for (auto &worker : workers) {
+      std::unique_lock<std::mutex> guard(worker->lock);
+      worker->idle.wait(guard, [&]() {
+        return worker->queue.empty() && !worker->busy;
+      });
+    }
+  }
+
+  // Forget what is known about process `tgid`, e.g. after it exec'd.
+  // Call flush() first.
+  auto reset_process(pid_t tgid) -> void {
+    for (auto &worker : workers) {
+      std::lock_guard<std::mutex> guard(worker->lock);
+      worker->unwinders.erase(tgid);
+      for (auto &pair : worker->profiles) {
+        if (pair.second.tgid == tgid) {
+          pair.second.tree.reset(new SymbolTree());
+        }
+      }
+    }
+  }
+
+  // Thread profiles of all workers. Call flush() first.
+  auto profiles(std::vector<ThreadProfile *> &out) -> void {
+    for (auto &worker : workers) {
+      for (auto &pair : worker->profiles) {
+        out.push_back(&pair.second);
+      }
+    }
+  }
+
+  auto unwind_ns() const -> u64 { return unwind_time.load(); }
+
+  auto failed() const -> u64 { return failures.load(); }
+
+private:
+  struct Job {
+    pid_t tid;
+    pid_t tgid;
+    StackSnapshot *snap;
+    u64 state_frame;
+  };
+
+  struct Worker {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<Job> queue;
+    bool busy = false;
+    bool stopping = false;
+    // Only touched by the worker, or while it is idle
+    ProfileSet profiles;
+    std::map<pid_t, std::unique_ptr<SnapshotUnwinder>> unwinders;
+  };
+
+  bool frame_pointers;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::unique_ptr<StackSnapshot>> snapshots;
+  std::mutex free_lock;
+  std::vector<StackSnapshot *> free_list;
+  std::atomic<u64> unwind_time{0};
+  std::atomic<u64> failures{0};
+
+  auto unwinder_for(Worker *w, pid_t tgid) -> SnapshotUnwinder * {
+    auto &unwinder = w->unwinders[tgid];
+    if (!unwinder) {
+      unwinder.reset(new SnapshotUnwinder(tgid));
+      if (!unwinder->init()) {
+        unwinder.reset();
+      }
+    }
+    return unwinder.get();
+  }
+
+  auto run(Worker *w) -> void {
+    std::vector<u64> frames;
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> guard(w->lock);
+        w->wake.wait(guard, [&]() { return w->stopping || !w->queue.empty(); });
+        if (w->queue.empty()) {
+          return;
+        }
+        job = w->queue.front();
+        w->queue.pop_front();
+        w->busy = true;
+      }
+
+      u64 start = monotonic_ns();
+      frames.clear();
+      bool ok;
+      if (frame_pointers) {
+        ok = unwind_frame_pointers(*job.snap, frames);
+      } else {
+        SnapshotUnwinder *unwinder = unwinder_for(w, job.tgid);
+        ok = unwinder && unwinder->unwind(*job.snap, frames);
+      }
+      release(job.snap);
+
+      if (ok) {
+        if (job.state_frame) {
+          frames.insert(frames.begin(), job.state_frame);
+        }
+        profile_for(w->profiles, job.tid, job.tgid)
+            .tree->insert(frames, 1, job.state_frame != 0);
+      } else {
+        failures++;
+      }
+      unwind_time += monotonic_ns() - start;
+
+      {
+        std::lock_guard<std::mutex> guard(w->lock);
+        w->busy = false;
+        if (w->queue.empty()) {
+          w->idle.notify_all();
+        }
+      }
+    }
+  }
+};
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <profile/tree.hpp>
+#include <utils.hpp>
+
+// Name keyed view of the SymbolTree, only built for the report
+struct ReportNode {
+  u64 count = 0;
+  u64 off_cpu = 0;
+  std::map<std::string, std::unique_ptr<ReportNode>> children;
+
+  // Samples whose leaf is this node
+  auto self() const -> u64 {
+    u64 res = count;
+    for (auto &pair : children) {
+      res -= pair.second->count;
+    }
+    return res;
+  }
+
+  auto self_off_cpu() const -> u64 {
+    u64 res = off_cpu;
+    for (auto &pair : children) {
+      res -= pair.second->off_cpu;
+    }
+    return res;
+  }
+};
+
+// Merge the address keyed children of `node` into `view` by name
+inline auto build_report(const SymbolNode *node, ReportNode *view,
+                         const NameTable &names) -> void {
+  SymbolTree::for_each_child(node, [&](const SymbolNode *child) {
+    auto it = names.find(child->addr);
+    ReportNode *target = view;
+    if (it != names.end() && !it->second.empty()) {
+      auto &slot = view->children[it->second];
+      if (!slot) {
+        slot.reset(new ReportNode());
+      }
+      target = slot.get();
+      target->count += child->count;
+      target->off_cpu += child->off_cpu;
+    }
+    build_report(child, target, names);
+  });
+}
+
+// Collapsed stacks as read by flamegraph.pl and most flame graph tools:
+// one "root;...;leaf count" line per distinct stack
+inline auto write_folded(FILE *fp, const ReportNode &root) -> void {
+  std::string stack;
+  auto walk = [&](const ReportNode &node, auto &&walk) -> void {
+    u64 self = node.self();
+    if (self && !stack.empty()) {
+      fprintf(fp, "%s %lu\n", stack.c_str(), self);
+    }
+    for (auto &pair : node.children) {
+      size_t len = stack.size();
+      if (len) {
+        stack += ';';
+      }
+      stack += pair.first;
+      walk(*pair.second, walk);
+      stack.resize(len);
+    }
+  };
+  walk(root, walk);
+}
+
+// Minimal protobuf encoder, enough for profile.proto
+class ProtoWriter {
+public:
+  auto varint(u32 field, u64 val) -> void {
+    key(field, 0);
+    raw_varint(val);
+  }
+
+  auto bytes(u32 field, const std::string &val) -> void {
+    key(field, 2);
+    raw_varint(val.size());
+    buf += val;
+  }
+
+  auto message(u32 field, const ProtoWriter &msg) -> void {
+    bytes(field, msg.buf);
+  }
+
+  auto packed(u32 field, const std::vector<u64> &vals) -> void {
+    ProtoWriter inner;
+    for (u64 val : vals) {
+      inner.raw_varint(val);
+    }
+    bytes(field, inner.buf);
+  }
+
+  auto data() const -> const std::string & { return buf; }
+
+private:
+  std::string buf;
+
+  auto key(u32 field, u32 wire_type) -> void {
+    raw_varint((u64)field << 3 | wire_type);
+  }
+
+  auto raw_varint(u64 val) -> void {
+    while (val >= 0x80) {
+      buf += (char)(val | 0x80);
+      val >>= 7;
+    }
+    buf += (char)val;
+  }
+};
+
+// What the samples of a report stand for
+struct PprofInfo {
+  u64 period_ns;
+  bool wall_clock;
+  u64 start_ns;
+  u64 duration_ns;
+};
+
+// Uncompressed profile.proto, which `pprof` reads as is. Locations are
+// functions since the report is keyed by name.
+inline auto write_pprof(FILE *fp, const ReportNode &root, const PprofInfo &info)
+    -> void {
+  std::vector<std::string> strings = {""};
+  std::map<std::string, u64> string_ids;
+  auto intern = [&](const std::string &s) -> u64 {
+    auto it = string_ids.find(s);
+    if (it != string_ids.end()) {
+      return it->second;
+    }
+    strings.push_back(s);
+    string_ids.emplace(s, strings.size() - 1);
+    return strings.size() - 1;
+  };
+  auto value_type = [&](const char *type, const char *unit) {
+    ProtoWriter vt;
+    vt.varint(1, intern(type));
+    vt.varint(2, intern(unit));
+    return vt;
+  };
+
+  ProtoWriter profile;
+  profile.message(1, value_type("samples", "count"));
+  profile.message(1, value_type(info.wall_clock ? "wall" : "cpu",
+                                "nanoseconds"));
+  if (info.wall_clock) {
+    profile.message(1, value_type("off_cpu", "count"));
+  }
+
+  // Function and location ids by name, both start at 1
+  std::map<std::string, u64> functions;
+  std::vector<u64> stack;
+  auto walk = [&](const ReportNode &node, auto &&walk) -> void {
+    u64 self = node.self();
+    if (self && !stack.empty()) {
+      ProtoWriter sample;
+      // Leaf first
+      sample.packed(1, std::vector<u64>(stack.rbegin(), stack.rend()));
+      std::vector<u64> values = {self, self * info.period_ns};
+      if (info.wall_clock) {
+        values.push_back(node.self_off_cpu());
+      }
+      sample.packed(2, values);
+      profile.message(2, sample);
+    }
+    for (auto &pair : node.children) {
+      auto it = functions.find(pair.first);
+      if (it == functions.end()) {
+        it = functions.emplace(pair.first, functions.size() + 1).first;
+      }
+      stack.push_back(it->second);
+      walk(*pair.second, walk);
+      stack.pop_back();
+    }
+  };
+  walk(root, walk);
+
+  for (auto &pair : functions) {
+    ProtoWriter line;
+    line.varint(1, pair.second);
+    ProtoWriter location;
+    location.varint(1, pair.second);
+    location.message(4, line);
+    profile.message(4, location);
+
+    ProtoWriter function;
+    function.varint(1, pair.second);
+    function.varint(2, intern(pair.first));
+    function.varint(3, intern(pair.first));
+    profile.message(5, function);
+  }
+
+  ProtoWriter period_type = value_type(info.wall_clock ? "wall" : "cpu",
+                                       "nanoseconds");
+  for (const std::string &s : strings) {
+    profile.bytes(6, s);
+  }
+  profile.varint(9, info.start_ns);
+  profile.varint(10, info.duration_ns);
+  profile.message(11, period_type);
+  profile.varint(12, info.period_ns);
+
+  fwrite(profile.data().data(), 1, profile.data().size(), fp);
+}
+
+enum class OutputFormat { Folded, Pprof };
+
+// Writes reports to files on a background thread, so a live snapshot only
+// holds the sampler up while the report is copied out of the trees
+class ProfileWriter {
+public:
+  ProfileWriter(OutputFormat format, const PprofInfo &info)
+      : format(format), info(info) {}
+
+  ProfileWriter(const ProfileWriter &) = delete;
+  ProfileWriter &operator=(const ProfileWriter &) = delete;
+
+  ~ProfileWriter() { wait(); }
+
+  // Write `report` to `path`; waits for the previous write first
+  auto write(std::unique_ptr<ReportNode> report, const std::string &path,
+             u64 duration_ns) -> void {
+    wait();
+    PprofInfo snapshot = info;
+    snapshot.duration_ns = duration_ns;
+    writer = std::thread([this, path, snapshot](
+                             std::unique_ptr<ReportNode> report) {
+      FILE *fp = fopen(path.c_str(), "w");
+      if (!fp) {
+        perror("CSPM: [ERROR] Cannot open profile output ");
+        return;
+      }
+      if (format == OutputFormat::Pprof) {
+        write_pprof(fp, *report, snapshot);
+      } else {
+        write_folded(fp, *report);
+      }
+      fclose(fp);
+    }, std::move(report));
+  }
+
+  auto wait() -> void {
+    if (writer.joinable()) {
+      writer.join();
+    }
+  }
+
+private:
+  OutputFormat format;
+  PprofInfo info;
+  std::thread writer;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <time.h>
+
+#include <timeit.hpp>
+#include <utils.hpp>
+
+// Drives sampling from absolute deadlines, so the period does not stretch by
+// the time a sample takes. Deadlines that have already passed when a tick
+// ends are skipped instead of being caught up in a burst.
+class SampleClock {
+public:
+  explicit SampleClock(u64 period_ns) : period(period_ns ? period_ns : 1) {}
+
+  auto start() -> void {
+    started = monotonic_ns();
+    deadline = started + period;
+  }
+
+  // Sleep until the next deadline
+  auto wait() -> void {
+    u64 now = monotonic_ns();
+    if (now >= deadline + period) {
+      // The tick overran at least one whole period
+      u64 behind = (now - deadline) / period;
+      missed += behind;
+      deadline += behind * period;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) ==
+           EINTR) {
+    }
+
+    u64 late = monotonic_ns() - deadline;
+    record(late);
+    ticks++;
+    deadline += period;
+  }
+
+  auto report() const -> void {
+    u64 elapsed = monotonic_ns() - started;
+    if (ticks == 0 || elapsed == 0) {
+      return;
+    }
+    printf("CSPM: sample rate: requested %.1f Hz, achieved %.1f Hz, "
+           "%lu deadlines missed\n",
+           1e9 / period, ticks * 1e9 / elapsed, missed);
+    printf("CSPM: wakeup jitter: mean %.2f us, p50 < %.2f us, p99 < %.2f us, "
+           "max %.2f us\n",
+           jitter_sum / 1e3 / ticks, percentile(0.50) / 1e3,
+           percentile(0.99) / 1e3, jitter_max / 1e3);
+    for (u32 i = 0; i < BUCKETS; ++i) {
+      if (histogram[i]) {
+        printf("CSPM:   < %8.2f us: %lu\n", bound(i) / 1e3, histogram[i]);
+      }
+    }
+  }
+
+private:
+  // Bucket i counts lateness below 2^i ns
+  static const u32 BUCKETS = 40;
+
+  u64 period;
+  u64 started = 0;
+  u64 deadline = 0;
+  u64 ticks = 0;
+  u64 missed = 0;
+  u64 jitter_sum = 0;
+  u64 jitter_max = 0;
+  u64 histogram[BUCKETS] = {0};
+
+  static auto bound(u32 bucket) -> u64 { return (u64)1 << bucket; }
+
+  auto record(u64 late) -> void {
+    jitter_sum += late;
+    if (late > jitter_max) {
+      jitter_max = late;
+    }
+    u32 bucket = late ? 64 - __builtin_clzll(late) : 0;
+    histogram[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+  }
+
+  // Upper bound of the bucket holding quantile `q`
+  auto percentile(f64 q) const -> u64 {
+    u64 rank = (u64)(q * ticks);
+    u64 seen = 0;
+    for (u32 i = 0; i < BUCKETS; ++i) {
+      seen += histogram[i];
+      if (seen > rank) {
+        return bound(i);
+      }
+    }
+    return bound(BUCKETS - 1);
+  }
+};
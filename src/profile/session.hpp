@@ -0,0 +1,649 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include <libunwind-ptrace.h>
+#include <libunwind-x86_64.h>
+#include <libunwind.h>
+
+#include <profile/capture.hpp>
+#include <profile/pool.hpp>
+#include <profile/symbolizer.hpp>
+#include <profile/threadstate.hpp>
+#include <profile/tree.hpp>
+#include <timeit.hpp>
+#include <utils.hpp>
+
+enum class Unwinder {
+  Remote,       // libunwind through _UPT while the target is stopped
+  Snapshot,     // libunwind over a copied stack after the target continued
+  FramePointer, // rbp chain over a copied stack after the target continued
+};
+
+// Overhead the sampler imposes on the target, accumulated over all samples
+struct SessionStats {
+  u64 samples = 0;
+  u64 failed = 0;
+  // Samples skipped because all snapshot buffers were queued
+  u64 dropped = 0;
+  // Time from PTRACE_INTERRUPT until the thread is observed stopped
+  u64 stop_ns = 0;
+  // Time spent copying registers and stack while the thread is stopped
+  u64 capture_ns = 0;
+  // Time spent unwinding, only while the thread is stopped for Remote
+  u64 unwind_ns = 0;
+  // Time from PTRACE_INTERRUPT until PTRACE_CONT, i.e. what the thread loses
+  u64 stopped_ns = 0;
+  u64 max_stopped_ns = 0;
+  // Samples of threads that were not running, in wall-clock mode
+  u64 off_cpu = 0;
+};
+
+// A long-lived ptrace/libunwind session on a target and everything it
+// spawns.
+//
+// Every thread under /proc/<pid>/task is seized once, and new threads and
+// processes are followed through PTRACE_O_TRACECLONE/TRACEFORK/TRACEVFORK.
+// The libunwind address space (with caching enabled) and UPT infos are kept
+// for the whole run, so each sample only pays for interrupting the threads,
+// unwinding and continuing them. With a snapshot unwinder the threads are
+// only stopped while their stacks are copied, and the unwinding is spread
+// over the worker threads of an UnwindPool.
+//
+// In wall-clock mode the state and wait channel of every thread are read
+// before it is interrupted, and samples of threads that were not running
+// are counted as off-CPU under a pseudo frame naming the state.
+//
+// All ptrace requests have to come from the thread that seized the target,
+// so the session must only be used from that thread.
+class SamplingSession {
+public:
+  explicit SamplingSession(pid_t target, Unwinder unwinder = Unwinder::Remote,
+                           u64 stack_size = 64 * 1024, u32 jobs = 1,
+                           bool wall_clock = false)
+      : target(target), unwinder(unwinder), stack_size(stack_size),
+        wall_clock(wall_clock) {
+    if (unwinder != Unwinder::Remote) {
+      pool.reset(new UnwindPool(unwinder == Unwinder::FramePointer, jobs));
+    }
+  }
+
+  SamplingSession(const SamplingSession &) = delete;
+  SamplingSession &operator=(const SamplingSession &) = delete;
+
+  ~SamplingSession() {
+    for (auto &pair : upt) {
+      _UPT_destroy(pair.second);
+    }
+    if (as) {
+      unw_destroy_addr_space(as);
+    }
+    for (auto &pair : tasks) {
+      ptrace(PTRACE_DETACH, pair.first, 0, 0);
+    }
+  }
+
+  // Called with the tid of every thread that is seized or followed
+  std::function<void(pid_t)> on_task;
+  // Called when a thread stops at exit, before the names of its process are
+  // resolved; samples taken elsewhere must be inserted by then
+  std::function<void(pid_t)> on_exit;
+
+  auto attach() -> bool {
+    as = unw_create_addr_space(&_UPT_accessors, 0);
+    if (!as) {
+      printf("CSPM: [ERROR] unw_create_addr_space failed\n");
+      return false;
+    }
+    unw_set_caching_policy(as, UNW_CACHE_GLOBAL);
+
+    return attach_process(target);
+  }
+
+  // Interrupt every thread, capture their stacks and let them run again
+  auto sample() -> void {
+    u64 start = monotonic_ns();
+
+    std::set<pid_t> pending;
+    for (auto &pair : tasks) {
+      if (!pair.second.started || pair.second.exiting) {
+        continue;
+      }
+      if (wall_clock) {
+        // Has to be read before the interrupt turns every thread into 't'
+        pair.second.state_frame = state_frame_of(pair.first);
+      }
+      if (ptrace(PTRACE_INTERRUPT, pair.first, 0, 0) == 0) {
+        pending.insert(pair.first);
+      }
+    }
+
+    while (!pending.empty()) {
+      int status;
+      pid_t tid = waitpid(-1, &status, __WALL);
+      if (tid == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("CSPM: [ERROR] waitpid failed ");
+        tasks.clear();
+        break;
+      }
+
+      bool sampled = pending.count(tid) > 0;
+      bool group_stop;
+      if (handle_status(tid, status, sampled ? &group_stop : nullptr)) {
+        take_sample(tid, group_stop, start);
+        pending.erase(tid);
+      } else if (!tasks.count(tid) || tasks[tid].exiting) {
+        pending.erase(tid);
+      }
+    }
+  }
+
+  // Reap pending events without stopping the target; false once every
+  // followed thread is gone
+  auto poll() -> bool {
+    while (!tasks.empty()) {
+      int status;
+      pid_t tid = waitpid(-1, &status, WNOHANG | __WALL);
+      if (tid == 0) {
+        break;
+      }
+      if (tid == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("CSPM: [ERROR] waitpid failed ");
+        tasks.clear();
+        break;
+      }
+      handle_status(tid, status);
+    }
+    return !tasks.empty();
+  }
+
+  // Add a sample taken outside of ptrace, e.g. by the perf backend
+  auto insert(pid_t tid, const u64 *frames, size_t n) -> void {
+    auto it = tasks.find(tid);
+    pid_t tgid = it != tasks.end() ? it->second.tgid : tid;
+    profile_for(profiles, tid, tgid).tree->insert(frames, n);
+  }
+
+  // Every thread profile; only complete once poll() returned false
+  auto collect(std::vector<ThreadProfile *> &out) -> void {
+    if (pool) {
+      pool->flush();
+      pool->profiles(out);
+    }
+    for (auto &pair : profiles) {
+      out.push_back(&pair.second);
+    }
+  }
+
+  // Resolve the names of every process that is still running, e.g. for a
+  // snapshot; exited processes were resolved when their last thread
+  // stopped at exit
+  auto resolve_live() -> void {
+    std::map<pid_t, pid_t> live;
+    for (auto &pair : tasks) {
+      if (!pair.second.exiting) {
+        live.emplace(pair.second.tgid, pair.first);
+      }
+    }
+    for (auto &pair : live) {
+      resolve(pair.first, pair.second);
+    }
+  }
+
+  auto names_of(pid_t tgid) -> const NameTable & { return names[tgid]; }
+
+  auto exit_status() const -> int { return status_code; }
+
+  auto overhead() const -> SessionStats {
+    SessionStats res = stats;
+    if (pool) {
+      res.failed += pool->failed();
+      res.unwind_ns += pool->unwind_ns();
+    }
+    return res;
+  }
+
+private:
+  struct Task {
+    pid_t tgid;
+    // Followed threads start stopped, the first stop is not a sample
+    bool started;
+    // Stopped at or past PTRACE_EVENT_EXIT
+    bool exiting;
+    // Pseudo frame of the state in wall-clock mode, 0 while running
+    u64 state_frame;
+  };
+
+  pid_t target;
+  Unwinder unwinder;
+  u64 stack_size;
+  bool wall_clock;
+  std::unique_ptr<UnwindPool> pool;
+  unw_addr_space_t as = nullptr;
+  // UPT infos by tid, for Remote unwinding
+  std::map<pid_t, void *> upt;
+  std::map<pid_t, Task> tasks;
+  // Profiles unwound or inserted on this thread
+  ProfileSet profiles;
+  // Names and symbolizers by tgid
+  std::map<pid_t, NameTable> names;
+  std::map<pid_t, std::unique_ptr<Symbolizer>> symbolizers;
+  // Wall-clock mode: state readers by tid, and the pseudo frames
+  std::map<pid_t, std::unique_ptr<ThreadStateReader>> states;
+  StateFrames state_frames;
+  std::vector<u64> frames;
+  int status_code = 0;
+  SessionStats stats;
+
+  static auto tgid_of(pid_t tid) -> pid_t {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", tid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+      return tid;
+    }
+    pid_t tgid = tid;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "Tgid: %d", &tgid) == 1) {
+        break;
+      }
+    }
+    fclose(fp);
+    return tgid;
+  }
+
+  // Seize every thread of `pid`, then every process it has already forked
+  auto attach_process(pid_t pid) -> bool {
+    // Threads may be created while we seize the others, so scan until no new
+    // thread shows up
+    bool found = true;
+    while (found) {
+      found = false;
+      char path[64];
+      snprintf(path, sizeof(path), "/proc/%d/task", pid);
+      DIR *dir = opendir(path);
+      if (!dir) {
+        // Already gone, unless it is the target itself
+        if (pid == target) {
+          perror("CSPM: [ERROR] Cannot open target task list ");
+        }
+        return pid != target;
+      }
+      while (struct dirent *entry = readdir(dir)) {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0 || tasks.count(tid)) {
+          continue;
+        }
+        if (!seize(tid, pid)) {
+          closedir(dir);
+          return false;
+        }
+        found = true;
+      }
+      closedir(dir);
+    }
+
+    // Forks from now on are followed, look for the ones that happened before
+    for (pid_t child : children_of(pid)) {
+      if (!tasks.count(child) && !attach_process(child)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // /proc/<pid>/task/<tid>/children is not always there, scan /proc instead
+  static auto children_of(pid_t pid) -> std::vector<pid_t> {
+    std::vector<pid_t> children;
+    DIR *dir = opendir("/proc");
+    if (!dir) {
+      return children;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+      pid_t child = atoi(entry->d_name);
+      if (child <= 0) {
+        continue;
+      }
+      char path[64];
+      snprintf(path, sizeof(path), "/proc/%d/stat", child);
+      FILE *fp = fopen(path, "r");
+      if (!fp) {
+        continue;
+      }
+      char line[512];
+      if (fgets(line, sizeof(line), fp)) {
+        // The command name may contain spaces, the ppid follows its ')'
+        char *p = strrchr(line, ')');
+        pid_t ppid;
+        if (p && sscanf(p + 1, " %*c %d", &ppid) == 1 && ppid == pid) {
+          children.push_back(child);
+        }
+      }
+      fclose(fp);
+    }
+    closedir(dir);
+    return children;
+  }
+
+  auto seize(pid_t tid, pid_t tgid) -> bool {
+    // PTRACE_SEIZE does not stop the thread, and lets us stop it later with
+    // PTRACE_INTERRUPT without sending it a signal. PTRACE_O_TRACEEXIT keeps
+    // the mappings around at exit so symbols can still be resolved.
+    long options = PTRACE_O_TRACEEXIT | PTRACE_O_TRACECLONE |
+                   PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                   PTRACE_O_TRACEEXEC;
+    if (ptrace(PTRACE_SEIZE, tid, 0, options) == -1) {
+      perror("CSPM: [ERROR] ptrace seize failed ");
+      return false;
+    }
+    tasks[tid] = {tgid, true, false, 0};
+    if (on_task) {
+      on_task(tid);
+    }
+    return true;
+  }
+
+  // Start following a thread or process reported by a clone/fork event. Its
+  // first stop may be reported before the event itself.
+  auto follow(pid_t tid) -> Task & {
+    auto it = tasks.find(tid);
+    if (it != tasks.end()) {
+      return it->second;
+    }
+    Task &task = tasks[tid];
+    task = {tgid_of(tid), false, false, 0};
+    if (on_task) {
+      on_task(tid);
+    }
+    return task;
+  }
+
+  auto ui_of(pid_t tid) -> void * {
+    void *&ui = upt[tid];
+    if (!ui) {
+      ui = _UPT_create(tid);
+    }
+    return ui;
+  }
+
+  auto forget(pid_t tid) -> void {
+    tasks.erase(tid);
+    states.erase(tid);
+    auto it = upt.find(tid);
+    if (it != upt.end()) {
+      if (it->second) {
+        _UPT_destroy(it->second);
+      }
+      upt.erase(it);
+    }
+  }
+
+  // Whether every thread of `tgid` we follow is stopped at or past exit
+  auto all_exiting(pid_t tgid) const -> bool {
+    for (auto &pair : tasks) {
+      if (pair.second.tgid == tgid && !pair.second.exiting) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Resolve the addresses of process `tgid` while its thread `tid` is
+  // stopped at exit and its mappings can still be read
+  auto resolve(pid_t tgid, pid_t tid) -> void {
+    std::vector<ThreadProfile *> all;
+    collect(all);
+
+    auto &symbolizer = symbolizers[tgid];
+    if (!symbolizer) {
+      symbolizer.reset(new Symbolizer(tid));
+    }
+    symbolizer->retarget(tid);
+    NameTable &table = names[tgid];
+    for (ThreadProfile *profile : all) {
+      if (profile->tgid != tgid) {
+        continue;
+      }
+      resolve_names(profile->tree->top(), table,
+                    [&](u64 addr, std::string &name) {
+                      if (StateFrames::is_state_frame(addr)) {
+                        return state_frames.name_of(addr, name);
+                      }
+                      return symbolizer->resolve(addr, name);
+                    });
+    }
+  }
+
+  // The process image was replaced; what was sampled before can no longer
+  // be symbolized and is dropped
+  auto reset_process(pid_t tgid) -> void {
+    if (pool) {
+      pool->flush();
+      pool->reset_process(tgid);
+    }
+    for (auto &pair : profiles) {
+      if (pair.second.tgid == tgid) {
+        pair.second.tree.reset(new SymbolTree());
+      }
+    }
+    names.erase(tgid);
+    symbolizers.erase(tgid);
+    for (auto &pair : tasks) {
+      if (pair.second.tgid == tgid) {
+        auto it = upt.find(pair.first);
+        if (it != upt.end()) {
+          if (it->second) {
+            _UPT_destroy(it->second);
+          }
+          upt.erase(it);
+        }
+      }
+    }
+    unw_flush_cache(as, 0, 0);
+  }
+
+  // Handle one wait status. Returns true if it is the interrupt (or group)
+  // stop of a thread we are sampling, i.e. when `group_stop` is given.
+  auto handle_status(pid_t tid, int status, bool *group_stop = nullptr)
+      -> bool {
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (tid == target) {
+        status_code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                        : 128 + WTERMSIG(status);
+      }
+      forget(tid);
+      return false;
+    }
+    if (!WIFSTOPPED(status)) {
+      return false;
+    }
+
+    Task &task = follow(tid);
+    unsigned long msg = 0;
+
+    switch (status >> 16) {
+    case PTRACE_EVENT_CLONE:
+    case PTRACE_EVENT_FORK:
+    case PTRACE_EVENT_VFORK:
+      ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg);
+      follow((pid_t)msg);
+      ptrace(PTRACE_CONT, tid, 0, 0);
+      return false;
+
+    case PTRACE_EVENT_EXEC:
+      // A non-leader thread that exec's takes over the tgid
+      ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg);
+      if ((pid_t)msg != tid) {
+        forget((pid_t)msg);
+      }
+      reset_process(task.tgid);
+      ptrace(PTRACE_CONT, tid, 0, 0);
+      return false;
+
+    case PTRACE_EVENT_EXIT:
+      task.exiting = true;
+      if (on_exit) {
+        on_exit(tid);
+      }
+      // Once per process: until its last thread exits, the others keep the
+      // mappings alive and may still add samples
+      if (all_exiting(task.tgid)) {
+        resolve(task.tgid, tid);
+      }
+      ptrace(PTRACE_CONT, tid, 0, 0);
+      return false;
+
+    case PTRACE_EVENT_STOP: {
+      int sig = WSTOPSIG(status);
+      bool is_group_stop = sig == SIGSTOP || sig == SIGTSTP ||
+                           sig == SIGTTIN || sig == SIGTTOU;
+      if (!task.started) {
+        // First stop of a followed thread
+        task.started = true;
+        ptrace(PTRACE_CONT, tid, 0, 0);
+        return false;
+      }
+      if (group_stop) {
+        *group_stop = is_group_stop;
+        return true;
+      }
+      // Not sampling this thread right now, let it go on
+      ptrace(is_group_stop ? PTRACE_LISTEN : PTRACE_CONT, tid, 0, 0);
+      return false;
+    }
+
+    default:
+      // Signal-delivery-stop: inject the signal back into the thread
+      ptrace(PTRACE_CONT, tid, 0, WSTOPSIG(status));
+      return false;
+    }
+  }
+
+  // Pseudo frame for the current state of `tid`, 0 if it is running
+  auto state_frame_of(pid_t tid) -> u64 {
+    auto &reader = states[tid];
+    if (!reader) {
+      reader.reset(new ThreadStateReader(tasks[tid].tgid, tid));
+    }
+    char state;
+    std::string wchan;
+    if (!reader->read(state, wchan) || is_on_cpu(state)) {
+      return 0;
+    }
+    return state_frames.frame_of(state, wchan);
+  }
+
+  auto take_sample(pid_t tid, bool group_stop, u64 start) -> void {
+    pid_t tgid = tasks[tid].tgid;
+    u64 state_frame = tasks[tid].state_frame;
+    u64 stopped = monotonic_ns();
+    u64 resumed;
+    bool ok = false;
+
+    if (unwinder == Unwinder::Remote) {
+      frames.clear();
+      ok = unwind(tid, frames);
+      u64 unwound = monotonic_ns();
+      ptrace(group_stop ? PTRACE_LISTEN : PTRACE_CONT, tid, 0, 0);
+      resumed = monotonic_ns();
+      stats.unwind_ns += unwound - stopped;
+      if (ok) {
+        if (state_frame) {
+          frames.insert(frames.begin(), state_frame);
+        }
+        profile_for(profiles, tid, tgid).tree->insert(frames, 1,
+                                                      state_frame != 0);
+      }
+    } else {
+      StackSnapshot *snap = pool->acquire();
+      if (snap) {
+        ok = capture_stack(tid, stack_size, *snap);
+      }
+      u64 captured = monotonic_ns();
+      ptrace(group_stop ? PTRACE_LISTEN : PTRACE_CONT, tid, 0, 0);
+      resumed = monotonic_ns();
+      if (!snap) {
+        stats.dropped++;
+        return;
+      }
+      if (ok) {
+        pool->submit(tid, tgid, snap, state_frame);
+      } else {
+        pool->release(snap);
+      }
+      stats.capture_ns += captured - stopped;
+    }
+
+    stats.samples++;
+    if (state_frame) {
+      stats.off_cpu++;
+    }
+    stats.stop_ns += stopped - start;
+    stats.stopped_ns += resumed - start;
+    if (resumed - start > stats.max_stopped_ns) {
+      stats.max_stopped_ns = resumed - start;
+    }
+    if (!ok) {
+      stats.failed++;
+    }
+  }
+
+  auto unwind(pid_t tid, std::vector<u64> &frames) -> bool {
+    void *ui = ui_of(tid);
+    if (!ui) {
+      printf("CSPM: [ERROR] _UPT_create failed\n");
+      return false;
+    }
+
+    unw_cursor_t cursor;
+    int res = unw_init_remote(&cursor, as, ui);
+    if (res != 0) {
+      printf("CSPM: [ERROR] unw_init_remote failed ");
+      switch (res) {
+      case UNW_EINVAL:
+        printf("(UNW_EINVAL)\n");
+        break;
+      case UNW_EUNSPEC:
+        printf("(UNW_EUNSPEC)\n");
+        break;
+      case UNW_EBADREG:
+        printf("(UNW_EBADREG)\n");
+        break;
+      default:
+        printf("(UNKNOWN %d)\n", res);
+        break;
+      }
+      return false;
+    }
+
+    // Only collect addresses here, names are resolved once at report time
+    do {
+      unw_word_t ip;
+      if (unw_get_reg(&cursor, UNW_REG_IP, &ip) != 0 || ip == 0) {
+        break;
+      }
+      frames.push_back(frames.empty() ? ip : ip - 1);
+    } while (unw_step(&cursor) > 0);
+
+    return true;
+  }
+};
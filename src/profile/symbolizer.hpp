@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include <timeit.hpp>
+#include <utils.hpp>
+
+// Function symbols of one ELF file from .symtab and .dynsym, parsed once.
+//
+// The start addresses are kept in Eytzinger (BFS) order, so a lookup walks
+// down an implicit binary tree whose top levels share a few cache lines.
+class ElfSymbols {
+public:
+  auto load(const std::string &path) -> bool {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+      close(fd);
+      return false;
+    }
+    size_t size = st.st_size;
+    void *image = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+      return false;
+    }
+
+    bool ok = parse((const u8 *)image, size);
+    munmap(image, size);
+    return ok;
+  }
+
+  // Translate a file offset (from /proc/<pid>/maps) to a link-time address
+  auto offset_to_vaddr(u64 offset, u64 &vaddr) const -> bool {
+    for (const Segment &seg : segments) {
+      if (offset >= seg.offset && offset < seg.offset + seg.size) {
+        vaddr = offset - seg.offset + seg.vaddr;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Name of the function containing link-time address `vaddr`
+  auto find(u64 vaddr) const -> const char * {
+    u64 n = symbols.size();
+    if (n == 0) {
+      return nullptr;
+    }
+
+    // Upper bound: the first start greater than vaddr
+    u64 k = 1;
+    while (k <= n) {
+      k = 2 * k + (eytzinger[k] <= vaddr);
+    }
+    k >>= __builtin_ffsll(~k);
+    u64 upper = k ? rank[k] : n;
+    if (upper == 0) {
+      return nullptr;
+    }
+
+    const Symbol &sym = symbols[upper - 1];
+    if (sym.size && vaddr >= sym.addr + sym.size) {
+      return nullptr;
+    }
+    return names.data() + sym.name;
+  }
+
+  auto count() const -> size_t { return symbols.size(); }
+
+private:
+  struct Segment {
+    u64 offset;
+    u64 size;
+    u64 vaddr;
+  };
+
+  struct Symbol {
+    u64 addr;
+    u64 size;
+    // Offset into names
+    u32 name;
+  };
+
+  std::vector<Segment> segments;
+  // Sorted by address
+  std::vector<Symbol> symbols;
+  std::string names;
+  // 1-based Eytzinger layout of the symbol addresses, and the sorted index
+  // of each slot
+  std::vector<u64> eytzinger;
+  std::vector<u32> rank;
+
+  auto parse(const u8 *image, size_t size) -> bool {
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+      return false;
+    }
+    if (ehdr->e_phoff + (u64)ehdr->e_phnum * sizeof(Elf64_Phdr) > size ||
+        ehdr->e_shoff + (u64)ehdr->e_shnum * sizeof(Elf64_Shdr) > size) {
+      return false;
+    }
+
+    const Elf64_Phdr *phdrs = (const Elf64_Phdr *)(image + ehdr->e_phoff);
+    for (u32 i = 0; i < ehdr->e_phnum; ++i) {
+      if (phdrs[i].p_type == PT_LOAD) {
+        segments.push_back(
+            {phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_vaddr});
+      }
+    }
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+    for (u32 i = 0; i < ehdr->e_shnum; ++i) {
+      if (shdrs[i].sh_type != SHT_SYMTAB && shdrs[i].sh_type != SHT_DYNSYM) {
+        continue;
+      }
+      if (shdrs[i].sh_link >= ehdr->e_shnum) {
+        continue;
+      }
+      const Elf64_Shdr &strtab = shdrs[shdrs[i].sh_link];
+      if (shdrs[i].sh_offset + shdrs[i].sh_size > size ||
+          strtab.sh_offset + strtab.sh_size > size) {
+        continue;
+      }
+      add_symbols(image + shdrs[i].sh_offset,
+                  shdrs[i].sh_size / sizeof(Elf64_Sym),
+                  (const char *)image + strtab.sh_offset, strtab.sh_size);
+    }
+
+    // .symtab and .dynsym overlap, keep one symbol per address
+    std::sort(symbols.begin(), symbols.end(),
+              [](const Symbol &a, const Symbol &b) {
+                return a.addr < b.addr || (a.addr == b.addr && a.size > b.size);
+              });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(),
+                              [](const Symbol &a, const Symbol &b) {
+                                return a.addr == b.addr;
+                              }),
+                  symbols.end());
+    symbols.shrink_to_fit();
+
+    eytzinger.assign(symbols.size() + 1, 0);
+    rank.assign(symbols.size() + 1, 0);
+    u64 next = 0;
+    build(1, next);
+    return true;
+  }
+
+  auto add_symbols(const u8 *table, u64 n, const char *strtab, u64 strsize)
+      -> void {
+    for (u64 i = 0; i < n; ++i) {
+      Elf64_Sym sym;
+      memcpy(&sym, table + i * sizeof(sym), sizeof(sym));
+      u8 type = ELF64_ST_TYPE(sym.st_info);
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+          sym.st_shndx == SHN_UNDEF || sym.st_value == 0 ||
+          sym.st_name >= strsize) {
+        continue;
+      }
+      symbols.push_back({sym.st_value, sym.st_size, (u32)names.size()});
+      names.append(strtab + sym.st_name,
+                   strnlen(strtab + sym.st_name, strsize - sym.st_name));
+      names.push_back('\0');
+    }
+  }
+
+  // In-order walk of the implicit tree assigns the sorted symbols to slots
+  auto build(u64 k, u64 &next) -> void {
+    if (k > symbols.size()) {
+      return;
+    }
+    build(2 * k, next);
+    eytzinger[k] = symbols[next].addr;
+    rank[k] = next;
+    next++;
+    build(2 * k + 1, next);
+  }
+};
+
+// Resolves addresses of one process through /proc/<pid>/maps and the
+// mapped ELF files. Each file is parsed once, even when several processes
+// map it. New mappings (dlopen) are picked up by re-reading the maps when
+// an address falls outside the known ones.
+class Symbolizer {
+public:
+  explicit Symbolizer(pid_t pid) : pid(pid) { refresh(); }
+
+  // Read the maps through another thread of the process, e.g. when the one
+  // the symbolizer was created for has exited
+  auto retarget(pid_t tid) -> void { pid = tid; }
+
+  auto resolve(u64 addr, std::string &name) -> bool {
+    const Mapping *map = find(addr);
+    if (!map && monotonic_ns() - refreshed > REFRESH_NS) {
+      refresh();
+      map = find(addr);
+    }
+    if (!map || !map->elf) {
+      return false;
+    }
+
+    u64 vaddr;
+    if (!map->elf->offset_to_vaddr(addr - map->start + map->offset, vaddr)) {
+      return false;
+    }
+    const char *sym = map->elf->find(vaddr);
+    if (!sym) {
+      return false;
+    }
+    name = sym;
+    return true;
+  }
+
+private:
+  // Re-read the maps at most this often when lookups miss
+  static const u64 REFRESH_NS = 10 * 1000 * 1000;
+
+  struct Mapping {
+    u64 start;
+    u64 end;
+    u64 offset;
+    const ElfSymbols *elf;
+  };
+
+  pid_t pid;
+  // Sorted by start
+  std::vector<Mapping> mappings;
+  u64 refreshed = 0;
+
+  // Parsed files by path, shared by all processes
+  static auto files() -> std::map<std::string, std::unique_ptr<ElfSymbols>> & {
+    static std::map<std::string, std::unique_ptr<ElfSymbols>> cache;
+    return cache;
+  }
+
+  static auto load(const std::string &path) -> const ElfSymbols * {
+    auto &slot = files()[path];
+    if (!slot) {
+      slot.reset(new ElfSymbols());
+      if (!slot->load(path)) {
+        // Remember the failure, keep an empty table
+        slot.reset(new ElfSymbols());
+      }
+    }
+    return slot.get();
+  }
+
+  auto refresh() -> void {
+    refreshed = monotonic_ns();
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+      return;
+    }
+
+    mappings.clear();
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+      u64 start, end, offset;
+      char perms[8];
+      int name_at = 0;
+      if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms,
+                 &offset, &name_at) < 4) {
+        continue;
+      }
+      if (perms[2] != 'x' || name_at == 0 || line[name_at] != '/') {
+        continue;
+      }
+      std::string file(line + name_at);
+      file.erase(file.find_last_not_of("\n") + 1);
+      mappings.push_back({start, end, offset, load(file)});
+    }
+    fclose(fp);
+
+    std::sort(mappings.begin(), mappings.end(),
+              [](const Mapping &a, const Mapping &b) {
+                return a.start < b.start;
+              });
+  }
+
+  auto find(u64 addr) const -> const Mapping * {
+    auto it = std::upper_bound(
+        mappings.begin(), mappings.end(), addr,
+        [](u64 addr, const Mapping &map) { return addr < map.start; });
+    if (it == mappings.begin()) {
+      return nullptr;
+    }
+    --it;
+    return addr < it->end ? &*it : nullptr;
+  }
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <string>
+#include <unistd.h>
+
+#include <utils.hpp>
+
+// Scheduler state and wait channel of one thread. The procfs files stay
+// open, so a sample costs two pread()s instead of two open()s.
+class ThreadStateReader {
+public:
+  ThreadStateReader(pid_t tgid, pid_t tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", tgid, tid);
+    stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/wchan", tgid, tid);
+    wchan_fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+
+  ThreadStateReader(const ThreadStateReader &) = delete;
+  ThreadStateReader &operator=(const ThreadStateReader &) = delete;
+
+  ~ThreadStateReader() {
+    if (stat_fd != -1) {
+      close(stat_fd);
+    }
+    if (wchan_fd != -1) {
+      close(wchan_fd);
+    }
+  }
+
+  // `state` is the letter of /proc/<pid>/stat (R, S, D, ...), `wchan` the
+  // kernel function the thread sleeps in, empty if the kernel hides it
+  auto read(char &state, std::string &wchan) -> bool {
+    char buf[512];
+    ssize_t n = stat_fd == -1 ? -1 : pread(stat_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+      return false;
+    }
+    buf[n] = 0;
+    // The command name may contain spaces, the state follows its ')'
+    char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 1, " %c", &state) != 1) {
+      return false;
+    }
+
+    wchan.clear();
+    n = wchan_fd == -1 ? -1 : pread(wchan_fd, buf, sizeof(buf) - 1, 0);
+    if (n > 0) {
+      buf[n] = 0;
+      buf[strcspn(buf, "\n")] = 0;
+      // "0" when not sleeping or when kallsyms is restricted
+      if (strcmp(buf, "0") != 0) {
+        wchan = buf;
+      }
+    }
+    return true;
+  }
+
+private:
+  int stat_fd = -1;
+  int wchan_fd = -1;
+};
+
+inline auto is_on_cpu(char state) -> bool { return state == 'R'; }
+
+// Off-CPU samples get a pseudo frame at the leaf that names the state and
+// wait channel, e.g. "[sleeping: do_epoll_wait]". Their addresses start
+// above the user address space, so they never collide with code.
+class StateFrames {
+public:
+  static const u64 BASE = 0xfffff00000000000ULL;
+
+  static auto is_state_frame(u64 addr) -> bool { return addr >= BASE; }
+
+  auto frame_of(char state, const std::string &wchan) -> u64 {
+    std::string name = "[";
+    name += state_name(state);
+    if (!wchan.empty()) {
+      name += ": " + wchan;
+    }
+    name += "]";
+
+    auto it = frames.find(name);
+    if (it != frames.end()) {
+      return it->second;
+    }
+    u64 addr = BASE + frames.size();
+    frames.emplace(name, addr);
+    names.emplace(addr, name);
+    return addr;
+  }
+
+  auto name_of(u64 addr, std::string &name) const -> bool {
+    auto it = names.find(addr);
+    if (it == names.end()) {
+      return false;
+    }
+    name = it->second;
+    return true;
+  }
+
+private:
+  std::map<std::string, u64> frames;
+  std::map<u64, std::string> names;
+
+  static auto state_name(char state) -> const char * {
+    switch (state) {
+    case 'S':
+      return "sleeping";
+    case 'D':
+      return "disk sleep";
+    case 'T':
+      return "stopped";
+    case 't':
+      return "tracing stop";
+    case 'Z':
+      return "zombie";
+    case 'I':
+      return "idle";
+    case 'P':
+      return "parked";
+    default:
+      return "unknown";
+    }
+  }
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include <utils.hpp>
+
+// Bump allocator for tree nodes and child tables. Nothing is freed before
+// the arena itself goes away.
+class Arena {
+public:
+  explicit Arena(size_t block_size = 1 << 20) : block_size(block_size) {}
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() {
+    for (u8 *block : blocks) {
+      free(block);
+    }
+  }
+
+  // Zeroed storage for `n` trivially constructible `T`s
+  template <typename T> auto alloc(size_t n = 1) -> T * {
+    size_t bytes = (sizeof(T) * n + alignof(u64) - 1) & ~(alignof(u64) - 1);
+    if (bytes > left) {
+      size_t size = bytes > block_size ? bytes : block_size;
+      current = (u8 *)calloc(1, size);
+      if (!current) {
+        printf("CSPM: [ERROR] Out of memory\n");
+        exit(1);
+      }
+      blocks.push_back(current);
+      left = size;
+    }
+    T *res = (T *)current;
+    current += bytes;
+    left -= bytes;
+    allocated += bytes;
+    return res;
+  }
+
+  auto bytes() const -> size_t { return allocated; }
+
+private:
+  size_t block_size;
+  std::vector<u8 *> blocks;
+  u8 *current = nullptr;
+  size_t left = 0;
+  size_t allocated = 0;
+};
+
+// A node of the call tree, keyed by the address of its frame. The children
+// are kept in an open addressing table of `capacity` (a power of two) slots.
+struct SymbolNode {
+  u64 addr;
+  u32 count;
+  // Part of count taken while the thread was not running
+  u32 off_cpu;
+  u32 size;
+  u32 capacity;
+  SymbolNode **slots;
+};
+
+// Call tree keyed by frame addresses. Samples only hash and compare u64s;
+// names are resolved once per unique address when the report is written.
+class SymbolTree {
+public:
+  SymbolTree() { root = arena.alloc<SymbolNode>(); }
+
+  // Add one sample. `frames` is leaf first; caller frames should already
+  // point into the call instruction (return address - 1).
+  auto insert(const u64 *frames, size_t n, u32 weight = 1,
+              bool off_cpu = false) -> void {
+    u32 off = off_cpu ? weight : 0;
+    SymbolNode *current = root;
+    current->count += weight;
+    current->off_cpu += off;
+    for (size_t i = n; i > 0; --i) {
+      current = child(current, frames[i - 1]);
+      current->count += weight;
+      current->off_cpu += off;
+    }
+  }
+
+  auto insert(const std::vector<u64> &frames, u32 weight = 1,
+              bool off_cpu = false) -> void {
+    insert(frames.data(), frames.size(), weight, off_cpu);
+  }
+
+  auto top() const -> const SymbolNode * { return root; }
+
+  auto nodes() const -> size_t { return node_count; }
+
+  auto memory() const -> size_t { return arena.bytes(); }
+
+  // Visit every child of `node`
+  template <typename F>
+  static auto for_each_child(const SymbolNode *node, F &&f) -> void {
+    for (u32 i = 0; i < node->capacity; ++i) {
+      if (node->slots[i]) {
+        f(node->slots[i]);
+      }
+    }
+  }
+
+private:
+  Arena arena;
+  SymbolNode *root;
+  size_t node_count = 0;
+  // Child tables dropped on growth, reused by capacity (index is log2)
+  std::vector<SymbolNode **> free_slots[32];
+
+  static auto hash(u64 addr) -> u64 {
+    return (addr * 0x9e3779b97f4a7c15ULL) >> 32;
+  }
+
+  auto alloc_slots(u32 capacity) -> SymbolNode ** {
+    auto &list = free_slots[__builtin_ctz(capacity)];
+    if (!list.empty()) {
+      SymbolNode **slots = list.back();
+      list.pop_back();
+      memset(slots, 0, sizeof(SymbolNode *) * capacity);
+      return slots;
+    }
+    return arena.alloc<SymbolNode *>(capacity);
+  }
+
+  static auto place(SymbolNode **slots, u32 capacity, SymbolNode *node)
+      -> void {
+    u32 mask = capacity - 1;
+    u32 i = hash(node->addr) & mask;
+    while (slots[i]) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = node;
+  }
+
+  auto grow(SymbolNode *node) -> void {
+    u32 capacity = node->capacity ? node->capacity * 2 : 2;
+    SymbolNode **slots = alloc_slots(capacity);
+    for (u32 i = 0; i < node->capacity; ++i) {
+      if (node->slots[i]) {
+        place(slots, capacity, node->slots[i]);
+      }
+    }
+    if (node->capacity) {
+      free_slots[__builtin_ctz(node->capacity)].push_back(node->slots);
+    }
+    node->slots = slots;
+    node->capacity = capacity;
+  }
+
+  auto child(SymbolNode *node, u64 addr) -> SymbolNode * {
+    if (node->capacity) {
+      u32 mask = node->capacity - 1;
+      for (u32 i = hash(addr) & mask; node->slots[i]; i = (i + 1) & mask) {
+        if (node->slots[i]->addr == addr) {
+          return node->slots[i];
+        }
+      }
+    }
+
+    // Keep the load factor at or below 3/4
+    if ((node->size + 1) * 4 > node->capacity * 3) {
+      grow(node);
+    }
+    SymbolNode *new_node = arena.alloc<SymbolNode>();
+    new_node->addr = addr;
+    place(node->slots, node->capacity, new_node);
+    node->size++;
+    node_count++;
+    return new_node;
+  }
+};
+
+// Names of the addresses of one process
+typedef std::unordered_map<u64, std::string> NameTable;
+
+// Resolve every address of the tree that is not in `names` yet.
+// `resolve(addr, name)` may fail, such frames are left out of the report.
+template <typename F>
+auto resolve_names(const SymbolNode *node, NameTable &names, F &&resolve)
+    -> void {
+  SymbolTree::for_each_child(node, [&](const SymbolNode *child) {
+    if (names.count(child->addr) == 0) {
+      std::string name;
+      if (!resolve(child->addr, name)) {
+        name.clear();
+      }
+      names.emplace(child->addr, name);
+    }
+    resolve_names(child, names, resolve);
+  });
+}
+
+// The call tree of one thread
+struct ThreadProfile {
+  pid_t tid;
+  pid_t tgid;
+  std::string comm;
+  std::unique_ptr<SymbolTree> tree;
+};
+
+// Thread profiles by tid
+typedef std::map<pid_t, ThreadProfile> ProfileSet;
+
+inline auto profile_for(ProfileSet &profiles, pid_t tid, pid_t tgid)
+    -> ThreadProfile & {
+  auto it = profiles.find(tid);
+  if (it != profiles.end()) {
+    return it->second;
+  }
+
+  ThreadProfile &profile = profiles[tid];
+  profile.tid = tid;
+  profile.tgid = tgid;
+  profile.tree.reset(new SymbolTree());
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/comm", tid);
+  FILE *fp = fopen(path, "r");
+  if (fp) {
+    char comm[64] = {0};
+    if (fgets(comm, sizeof(comm), fp)) {
+      comm[strcspn(comm, "\n")] = 0;
+      profile.comm = comm;
+    }
+    fclose(fp);
+  }
+  return profile;
+}
@@ -1,42 +1,356 @@
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
 
 #include <cxxopts.hpp>
 
+#include "measure.hpp"
 #include "timeit.hpp"
 
+extern char **environ;
+
+// Split a command line into arguments the way a shell would, without any
+// expansion: whitespace separates, quotes group, backslash escapes
+auto split_command(const std::string &line, std::vector<std::string> &args)
+    -> bool {
+  std::string arg;
+  bool in_arg = false;
+  char quote = 0;
+  for (size_t i = 0; i < line.size(); ++i) {
+    char c = line[i];
+    if (quote) {
+      if (c == quote) {
+        quote = 0;
+      } else if (c == '\\' && quote == '"' && i + 1 < line.size()) {
+        arg += line[++i];
+      } else {
+        arg += c;
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      in_arg = true;
+    } else if (c == '\\' && i + 1 < line.size()) {
+      arg += line[++i];
+      in_arg = true;
+    } else if (c == ' ' || c == '\t' || c == '\n') {
+      if (in_arg) {
+        args.push_back(arg);
+        arg.clear();
+        in_arg = false;
+      }
+    } else {
+      arg += c;
+      in_arg = true;
+    }
+  }
+  if (in_arg) {
+    args.push_back(arg);
+  }
+  return quote == 0 && !args.empty();
+}
+
+// One run of a command, times in ns
+struct Run {
+  u64 wall;
+  u64 user;
+  u64 sys;
+  u64 max_rss_kb;
+  u64 major_faults;
+  u64 minor_faults;
+  u64 voluntary_switches;
+  u64 involuntary_switches;
+  int status;
+};
+
+struct Command {
+  std::string line;
+  std::vector<std::string> args;
+  std::vector<Run> runs;
+};
+
+inline auto timeval_ns(const struct timeval &tv) -> u64 {
+  return (u64)tv.tv_sec * 1000000000 + (u64)tv.tv_usec * 1000;
+}
+
+// Spawn the command directly (no shell in between) and reap it with wait4
+// for its resource usage. The wall time covers spawn to reap.
+auto run_once(const Command &command, u8 mode, bool quiet, Run &run) -> bool {
+  std::vector<char *> argv;
+  for (const std::string &arg : command.args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (quiet) {
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+  }
+
+  int err = 0;
+  int status = 0;
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  auto spawn_and_wait = [&]() {
+    pid_t pid;
+    err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    if (err) {
+      return;
+    }
+    while (wait4(pid, &status, 0, &usage) < 0) {
+      if (errno != EINTR) {
+        err = errno;
+        return;
+      }
+    }
+  };
+
+  if (mode == 0) {
+    run.wall = timeit_syscall(spawn_and_wait) * 1000;
+  } else {
+    run.wall = (u64)TscClock::get().ns(timeit_rdtsc(spawn_and_wait));
+  }
+  posix_spawn_file_actions_destroy(&actions);
+  if (err) {
+    printf("CSPM: [ERROR] Cannot run %s: %s\n", command.line.c_str(),
+           strerror(err));
+    return false;
+  }
+
+  run.user = timeval_ns(usage.ru_utime);
+  run.sys = timeval_ns(usage.ru_stime);
+  run.max_rss_kb = usage.ru_maxrss;
+  run.major_faults = usage.ru_majflt;
+  run.minor_faults = usage.ru_minflt;
+  run.voluntary_switches = usage.ru_nvcsw;
+  run.involuntary_switches = usage.ru_nivcsw;
+  run.status = status;
+  return true;
+}
+
+// Stats of one field over the runs
+template <typename F>
+inline auto stats_of(const std::vector<Run> &runs, F &&field) -> Stats {
+  std::vector<f64> samples;
+  for (const Run &run : runs) {
+    samples.push_back((f64)field(run));
+  }
+  return summarize(samples);
+}
+
+auto print_command(const Command &command) -> void {
+  const std::vector<Run> &runs = command.runs;
+  printf("===== %s =====\n", command.line.c_str());
+  print_stats("Wall", stats_of(runs, [](const Run &r) { return r.wall; }));
+  print_stats("User", stats_of(runs, [](const Run &r) { return r.user; }));
+  print_stats("Sys", stats_of(runs, [](const Run &r) { return r.sys; }));
+
+  // Counters as medians
+  auto median = [&](auto field) { return stats_of(runs, field).median; };
+  printf("Max RSS: %.0f KiB\n", median([](const Run &r) { return r.max_rss_kb; }));
+  printf("Faults: %.0f major, %.0f minor\n",
+         median([](const Run &r) { return r.major_faults; }),
+         median([](const Run &r) { return r.minor_faults; }));
+  printf("Context switches: %.0f voluntary, %.0f involuntary\n",
+         median([](const Run &r) { return r.voluntary_switches; }),
+         median([](const Run &r) { return r.involuntary_switches; }));
+}
+
+// Every command against the first: the ratio of the median wall times,
+// with the interval spanned by the two medians' 95% CIs
+auto print_comparison(const std::vector<Command> &commands) -> void {
+  auto wall = [](const Run &r) { return r.wall; };
+  Stats base = stats_of(commands[0].runs, wall);
+  printf("===== Comparison =====\n");
+  printf("%s: baseline\n", commands[0].line.c_str());
+  for (size_t i = 1; i < commands.size(); ++i) {
+    Stats stats = stats_of(commands[i].runs, wall);
+    // The clock can round very short runs down to 0
+    if (base.ci_low <= 0 || stats.ci_low <= 0) {
+      printf("%s: too short to compare, runs measured as 0\n",
+             commands[i].line.c_str());
+      continue;
+    }
+    f64 speedup = base.median / stats.median;
+    f64 low = base.ci_low / stats.ci_high;
+    f64 high = base.ci_high / stats.ci_low;
+    const char *verdict = low > 1    ? "faster"
+                          : high < 1 ? "slower"
+                                     : "no significant difference";
+    printf("%s: %.3fx speedup (95%% CI %.3fx - %.3fx), %s\n",
+           commands[i].line.c_str(), speedup, low, high, verdict);
+  }
+}
+
+auto export_runs(const std::string &path, const std::vector<Command> &commands)
+    -> void {
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    perror("CSPM: [ERROR] Cannot open export file ");
+    return;
+  }
+  fprintf(fp, "command,run,wall_ns,user_ns,sys_ns,max_rss_kb,major_faults,"
+              "minor_faults,voluntary_switches,involuntary_switches,status\n");
+  for (const Command &command : commands) {
+    // Quote the command, doubling its quotes
+    std::string quoted = "\"";
+    for (char c : command.line) {
+      quoted += c == '"' ? "\"\"" : std::string(1, c);
+    }
+    quoted += "\"";
+    for (size_t i = 0; i < command.runs.size(); ++i) {
+      const Run &r = command.runs[i];
+      fprintf(fp, "%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%d\n",
+              quoted.c_str(), i, r.wall, r.user, r.sys, r.max_rss_kb,
+              r.major_faults, r.minor_faults, r.voluntary_switches,
+              r.involuntary_switches, r.status);
+    }
+  }
+  fclose(fp);
+}
+
+// Index of the first command in argv. Our options end at the first
+// argument that is neither an option nor the value of one, or at "--", so
+// the options of a command are never taken for ours.
+auto first_command(int argc, char **argv) -> int {
+  // Options with their value in the next argument
+  const char *with_value[] = {"-m", "--mode",   "-n", "--runs",
+                              "-w", "--warmup", "-e", "--export"};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      return i + 1;
+    }
+    if (arg.size() < 2 || arg[0] != '-') {
+      return i;
+    }
+    for (const char *option : with_value) {
+      if (arg == option) {
+        ++i;
+        break;
+      }
+    }
+  }
+  return argc;
+}
+
 auto main(int argc, char **argv) -> int {
-  cxxopts::Options options("timeit", "Time a command");
+  cxxopts::Options options(
+      "timeit", "Time commands, each one a single (quoted) argument, e.g.\n"
+                "  timeit -n 20 \"ls -l\" \"ls -la\"");
 
   u8 mode;
-  std::string cmd;
+  u32 runs;
+  u32 warmup;
+  bool shell;
+  bool quiet;
+  bool ignore_failure;
+  std::string export_file;
 
   // clang-format off
   options.add_options()
     ("h,help", "Print help")
     ("m,mode", "Mode to use (0: syscall, 1: rdtsc)", cxxopts::value<u8>(mode)->default_value("0"))
-    ("cmd", "Command to run", cxxopts::value(cmd))
+    ("n,runs", "Timed runs of every command (default: 10)", cxxopts::value(runs)->default_value("10"))
+    ("w,warmup", "Untimed runs of every command first (default: 0)", cxxopts::value(warmup)->default_value("0"))
+    ("shell", "Run the commands through /bin/sh -c instead of spawning them directly",
+    cxxopts::value(shell)->default_value("false"))
+    ("q,quiet", "Send the commands' stdout to /dev/null", cxxopts::value(quiet)->default_value("false"))
+    ("i,ignore-failure", "Keep going when a command exits with non-zero status",
+    cxxopts::value(ignore_failure)->default_value("false"))
+    ("e,export", "Write every run to this CSV file", cxxopts::value(export_file)->default_value(""))
   ;
   // clang-format on
 
-  options.parse_positional({"cmd"});
+  options.positional_help("\"cmd [args]\"...");
 
-  auto result = options.parse(argc, argv);
+  int first = first_command(argc, argv);
+  bool dashes = first > 1 && strcmp(argv[first - 1], "--") == 0;
+  auto result = options.parse(dashes ? first - 1 : first, argv);
 
-  if (result["help"].as<bool>() || !result.count("cmd")) {
+  // Every argument from the first command on is a command; with several
+  // they are compared against the first
+  std::vector<std::string> lines(argv + first, argv + argc);
+  if (result["help"].as<bool>() || lines.empty()) {
     printf("%s\n", options.help().c_str());
     return 0;
   }
+  for (const std::string &line : lines) {
+    if (line[0] == '-') {
+      printf("CSPM: [ERROR] %s is not a command: quote every command with "
+             "its arguments, e.g. timeit \"ls -l\"\n",
+             line.c_str());
+      return 1;
+    }
+  }
 
-  switch (mode) {
-  case 0: {
-    u64 us = timeit_syscall([&]() { system(cmd.c_str()); });
-    printf("timeit_syscall: %lu us\n", us);
-    return 0;
+  if (runs == 0) {
+    printf("CSPM: [ERROR] --runs must be positive\n");
+    return 1;
   }
-  case 1: {
-    u64 cycles = timeit_rdtsc([&]() { system(cmd.c_str()); });
-    printf("timeit_rdtsc: %lu cycles\n", cycles);
-    return 0;
+  if (mode > 1) {
+    printf("CSPM: [ERROR] Unknown mode: %u\n", mode);
+    return 1;
+  }
+
+  std::vector<Command> commands;
+  for (const std::string &line : lines) {
+    Command command = {line, {}, {}};
+    if (shell) {
+      command.args = {"/bin/sh", "-c", line};
+    } else if (!split_command(line, command.args)) {
+      printf("CSPM: [ERROR] Cannot parse command: %s\n", line.c_str());
+      return 1;
+    }
+    commands.push_back(command);
+  }
+  if (mode == 1) {
+    print_clock();
+  }
+
+  Run run;
+  for (const Command &command : commands) {
+    for (u32 i = 0; i < warmup; ++i) {
+      if (!run_once(command, mode, quiet, run)) {
+        return 1;
+      }
+    }
+  }
+
+  // Interleave the commands, so drift over time hits all of them alike
+  for (u32 i = 0; i < runs; ++i) {
+    for (Command &command : commands) {
+      if (!run_once(command, mode, quiet, run)) {
+        return 1;
+      }
+      if (run.status != 0 && !ignore_failure) {
+        printf("CSPM: [ERROR] %s exited with status %d (use "
+               "--ignore-failure to keep going)\n",
+               command.line.c_str(),
+               WIFEXITED(run.status) ? WEXITSTATUS(run.status)
+                                     : 128 + WTERMSIG(run.status));
+        return 1;
+      }
+      command.runs.push_back(run);
+    }
+  }
+
+  for (const Command &command : commands) {
+    print_command(command);
+  }
+  if (commands.size() > 1) {
+    print_comparison(commands);
   }
+  if (!export_file.empty()) {
+    export_runs(export_file, commands);
   }
-}
\ No newline at end of file
+  return 0;
+}
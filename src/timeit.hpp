@@ -1,11 +1,59 @@
 #pragma once
 
 #include <sys/time.h>
+#include <time.h>
+#include <type_traits>
 #include <x86intrin.h>
 
 #include "utils.hpp"
 
-inline u64 timeit_syscall(std::function<void()> f) {
+// Header-only timers. Callables are template parameters, so the measured
+// code is inlined into the timed region instead of called through a
+// std::function.
+
+// Keep `value` (and the work that produced it) alive: the compiler has to
+// assume the asm reads it
+template <typename T> inline auto do_not_optimize(const T &value) -> void {
+  __asm__ volatile("" : : "r,m"(value) : "memory");
+}
+
+// Same, and the asm may also write it, so later reads are not folded. GCC
+// rejects "+r,m" on an lvalue as an impossible constraint, and "+m,r"
+// loses floating-point values, so it gets one constraint by type.
+template <typename T> inline auto do_not_optimize(T &value) -> void {
+#if defined(__clang__)
+  __asm__ volatile("" : "+r,m"(value) : : "memory");
+#else
+  if constexpr (std::is_trivially_copyable<T>::value &&
+                sizeof(T) <= sizeof(void *)) {
+    __asm__ volatile("" : "+r"(value) : : "memory");
+  } else {
+    __asm__ volatile("" : "+m"(value) : : "memory");
+  }
+#endif
+}
+
+// Force pending stores to memory and forget what memory holds
+inline auto clobber_memory() -> void { __asm__ volatile("" : : : "memory"); }
+
+// TSC at the start of a timed region: the lfences keep earlier
+// instructions from finishing inside it and later ones from starting early
+inline auto tsc_begin() -> u64 {
+  _mm_lfence();
+  u64 tsc = __rdtsc();
+  _mm_lfence();
+  return tsc;
+}
+
+// TSC at the end of a timed region: rdtscp waits for everything before it
+inline auto tsc_end() -> u64 {
+  u32 aux;
+  u64 tsc = __rdtscp(&aux);
+  _mm_lfence();
+  return tsc;
+}
+
+template <typename F> inline auto timeit_syscall(F &&f) -> u64 {
   struct timeval start, end;
   gettimeofday(&start, NULL);
   f();
@@ -13,9 +61,49 @@ inline u64 timeit_syscall(std::function<void()> f) {
   return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
 }
 
-inline u64 timeit_rdtsc(std::function<void()> f) {
-  u64 start = __rdtsc();
+template <typename F> inline auto timeit_rdtsc(F &&f) -> u64 {
+  u64 start = tsc_begin();
   f();
-  u64 end = __rdtsc();
-  return end - start;
-}
\ No newline at end of file
+  return tsc_end() - start;
+}
+
+// Ticks of `batch` calls of `f`. The empty asm keeps the loop itself, so
+// an empty `f` measures the loop and timer overhead.
+template <typename F> inline auto timeit_batch(F &&f, u64 batch) -> u64 {
+  u64 start = tsc_begin();
+  for (u64 i = 0; i < batch; ++i) {
+    f();
+    __asm__ volatile("");
+  }
+  return tsc_end() - start;
+}
+
+// Overhead to subtract from timeit_batch(f, batch): the fewest ticks of
+// `tries` empty batches
+inline auto empty_loop_ticks(u64 batch, u32 tries = 32) -> u64 {
+  u64 best = UINT64_MAX;
+  for (u32 i = 0; i < tries; ++i) {
+    u64 ticks = timeit_batch([]() {}, batch);
+    best = ticks < best ? ticks : best;
+  }
+  return best;
+}
+
+// Smallest power-of-two batch of calls of `f` that takes `min_ticks`, so
+// calls near the resolution of the TSC can be timed. One call first, so a
+// lazy initialization does not pass for a slow call.
+template <typename F>
+inline auto calibrate_batch(F &&f, u64 min_ticks) -> u64 {
+  f();
+  u64 batch = 1;
+  while (batch < (1ul << 30) && timeit_batch(f, batch) < min_ticks) {
+    batch *= 2;
+  }
+  return batch;
+}
+
+inline u64 monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
@@ -0,0 +1,56 @@
+#include <cstdio>
+
+#include "timeit.hpp"
+
+// Checks of the benchmark helpers of timeit.hpp. Building this file is
+// half the test: do_not_optimize must compile on lvalue locals.
+
+struct Pair {
+  int a;
+  int b;
+};
+
+struct Block {
+  char bytes[64];
+};
+
+static auto check(bool ok, const char *what) -> int {
+  printf("CSPM: [%s] %s\n", ok ? "INFO" : "ERROR", what);
+  return ok ? 0 : 1;
+}
+
+auto main() -> int {
+  int failed = 0;
+
+  // The asm may write the values, but must not change them
+  int i = 42;
+  do_not_optimize(i);
+  failed += check(i == 42, "int lvalue");
+
+  double d = 2.5;
+  do_not_optimize(d);
+  failed += check(d == 2.5, "double lvalue");
+
+  Pair pair = {3, 4};
+  do_not_optimize(pair);
+  failed += check(pair.a == 3 && pair.b == 4, "small struct lvalue");
+
+  Block block = {};
+  block.bytes[63] = 7;
+  do_not_optimize(block);
+  failed += check(block.bytes[63] == 7, "large struct lvalue");
+
+  const double c = 1.5;
+  do_not_optimize(c);
+  do_not_optimize(i + 1);
+  clobber_memory();
+
+  // A loop of do_not_optimize calls is kept and takes time
+  u64 ticks = timeit_rdtsc([&]() {
+    for (int n = 0; n < 1000; ++n) {
+      do_not_optimize(n);
+    }
+  });
+  failed += check(ticks > 0, "timed loop is kept");
+  return failed ? 1 : 0;
+}
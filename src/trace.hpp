@@ -0,0 +1,399 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <x86intrin.h>
+
+#include "measure.hpp"
+#include "utils.hpp"
+
+// In-process scoped tracing:
+//
+//   trace_start("trace.json");
+//   {
+//     CSPM_SCOPE("parse");
+//     ...
+//   }
+//   trace_stop();
+//
+// Scopes write TSC-stamped records into a ring of their own thread, with
+// no locks or syscalls. A background thread drains the rings into a
+// Chrome trace-event file (chrome://tracing, Perfetto) and per-scope
+// latency histograms, printed by trace_stop(). While tracing is off a
+// scope costs one relaxed load and a branch; define CSPM_TRACE_DISABLE to
+// compile the scopes out.
+//
+// Every thread's ring holds TraceRing::CAPACITY (32768) records, 1 MiB, and
+// is drained every 10 ms. A thread that records faster than that fills its
+// ring, and further records are dropped, never waited for: the trace and
+// the histograms miss them, and trace_stop() only prints how many.
+
+enum class TraceKind : u8 { Complete, Begin, End };
+
+struct TraceRecord {
+  // A string literal, only dereferenced by the flusher. End records carry
+  // the name of their Begin, to pair them when records were dropped.
+  const char *name;
+  u64 begin;
+  u64 end;
+  TraceKind kind;
+};
+
+// Single-producer single-consumer ring: the traced thread pushes, the
+// flusher pops. A full ring drops records instead of blocking, and counts
+// them in `dropped`.
+struct TraceRing {
+  // Records, a power of two
+  static const u64 CAPACITY = 1 << 15;
+
+  alignas(64) std::atomic<u64> head{0};
+  // Last tail the producer saw, to skip the shared load while not full
+  u64 cached_tail = 0;
+  alignas(64) std::atomic<u64> tail{0};
+  alignas(64) std::atomic<u64> dropped{0};
+  // Set while the producer pushes, so stop() can wait for it
+  std::atomic<bool> pushing{false};
+  int tid = 0;
+  // Open Begin records, for the flusher
+  std::vector<TraceRecord> open;
+  TraceRecord records[CAPACITY];
+
+  auto push(const TraceRecord &record) -> void {
+    u64 h = head.load(std::memory_order_relaxed);
+    if (h - cached_tail >= CAPACITY) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h - cached_tail >= CAPACITY) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    records[h & (CAPACITY - 1)] = record;
+    head.store(h + 1, std::memory_order_release);
+  }
+};
+
+inline std::atomic<bool> trace_enabled{false};
+inline thread_local TraceRing *trace_ring = nullptr;
+
+// Durations of one scope in log-linear buckets: four per power of two,
+// so percentiles are within 19%
+struct TraceHistogram {
+  u64 count = 0;
+  u64 sum = 0;
+  u64 min = UINT64_MAX;
+  u64 max = 0;
+  u64 buckets[64 * 4] = {};
+
+  static auto bucket_of(u64 ticks) -> u32 {
+    if (ticks < 4) {
+      return ticks;
+    }
+    u32 msb = 63 - __builtin_clzll(ticks);
+    return msb * 4 + ((ticks >> (msb - 2)) & 3);
+  }
+
+  // Upper bound of a bucket
+  static auto limit_of(u32 bucket) -> u64 {
+    if (bucket < 4) {
+      return bucket;
+    }
+    u32 msb = bucket / 4;
+    return ((4 | (bucket & 3)) + 1ul) << (msb - 2);
+  }
+
+  auto add(u64 ticks) -> void {
+    ++count;
+    sum += ticks;
+    min = ticks < min ? ticks : min;
+    max = ticks > max ? ticks : max;
+    ++buckets[bucket_of(ticks)];
+  }
+
+  auto percentile(f64 p) const -> u64 {
+    u64 rank = (u64)(p * count);
+    u64 seen = 0;
+    for (u32 i = 0; i < 64 * 4; ++i) {
+      seen += buckets[i];
+      if (seen > rank) {
+        u64 limit = limit_of(i);
+        return limit < max ? limit : max;
+      }
+    }
+    return max;
+  }
+};
+
+class Tracer {
+public:
+  static auto get() -> Tracer & {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  auto start(const char *path) -> bool {
+    std::lock_guard<std::mutex> guard(lock);
+    if (running) {
+      return false;
+    }
+    fp = fopen(path, "w");
+    if (!fp) {
+      perror("CSPM: [ERROR] Cannot open trace file ");
+      return false;
+    }
+    fprintf(fp, "[\n");
+    first_event = true;
+    pid = getpid();
+    // Calibrate before the first record, not in the flusher
+    TscClock::get();
+    origin = __rdtsc();
+    histograms.clear();
+    for (auto &ring : rings) {
+      ring->open.clear();
+      ring->dropped.store(0, std::memory_order_relaxed);
+    }
+    running = true;
+    flusher = std::thread([this]() { flush_loop(); });
+    trace_enabled.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  auto stop() -> void {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!running) {
+        return;
+      }
+      trace_enabled.store(false, std::memory_order_seq_cst);
+      running = false;
+    }
+    flusher.join();
+    // A push that saw tracing enabled finishes before the last drain
+    quiesce();
+    drain();
+    fprintf(fp, "\n]\n");
+    fclose(fp);
+    fp = nullptr;
+    print_histograms();
+  }
+
+  // The ring of the calling thread, created on its first record. Rings
+  // live as long as the process, so records of exited threads still get
+  // flushed.
+  __attribute__((noinline)) auto register_thread() -> TraceRing * {
+    std::lock_guard<std::mutex> guard(lock);
+    rings.emplace_back(new TraceRing());
+    TraceRing *ring = rings.back().get();
+    ring->tid = syscall(SYS_gettid);
+    trace_ring = ring;
+    return ring;
+  }
+
+private:
+  Tracer() = default;
+
+  auto quiesce() -> void {
+    std::vector<TraceRing *> current;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (auto &ring : rings) {
+        current.push_back(ring.get());
+      }
+    }
+    for (TraceRing *ring : current) {
+      while (ring->pushing.load(std::memory_order_seq_cst)) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  auto flush_loop() -> void {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!running) {
+          return;
+        }
+      }
+      drain();
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  // Move everything pushed so far out of the rings
+  auto drain() -> void {
+    std::vector<TraceRing *> current;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (auto &ring : rings) {
+        current.push_back(ring.get());
+      }
+    }
+    for (TraceRing *ring : current) {
+      u64 t = ring->tail.load(std::memory_order_relaxed);
+      u64 h = ring->head.load(std::memory_order_acquire);
+      for (; t < h; ++t) {
+        consume(*ring, ring->records[t & (TraceRing::CAPACITY - 1)]);
+      }
+      ring->tail.store(t, std::memory_order_release);
+    }
+  }
+
+  auto consume(TraceRing &ring, const TraceRecord &record) -> void {
+    switch (record.kind) {
+    case TraceKind::Complete:
+      write_event(ring, record.name, "X", record.begin, record.end);
+      histograms[record.name].add(record.end - record.begin);
+      break;
+    case TraceKind::Begin:
+      write_event(ring, record.name, "B", record.begin, 0);
+      ring.open.push_back(record);
+      break;
+    case TraceKind::End: {
+      // The innermost open Begin of the same name. Begins above it lost
+      // their End to a full ring; an End without Begin is skipped.
+      auto it = ring.open.rbegin();
+      while (it != ring.open.rend() && std::strcmp(it->name, record.name)) {
+        ++it;
+      }
+      if (it == ring.open.rend()) {
+        break;
+      }
+      write_event(ring, record.name, "E", record.begin, 0);
+      histograms[it->name].add(record.begin - it->begin);
+      ring.open.erase(std::next(it).base(), ring.open.end());
+      break;
+    }
+    }
+  }
+
+  auto micros(u64 tsc) const -> f64 {
+    return TscClock::get().ns((f64)tsc - (f64)origin) / 1000;
+  }
+
+  auto write_event(const TraceRing &ring, const char *name, const char *phase,
+                   u64 begin, u64 end) -> void {
+    fprintf(fp, "%s{\"name\":\"", first_event ? "" : ",\n");
+    first_event = false;
+    for (const char *c = name; *c; ++c) {
+      if (*c == '"' || *c == '\\') {
+        fputc('\\', fp);
+      }
+      fputc(*c, fp);
+    }
+    fprintf(fp, "\",\"ph\":\"%s\",\"ts\":%.3f,", phase, micros(begin));
+    if (end) {
+      fprintf(fp, "\"dur\":%.3f,", micros(end) - micros(begin));
+    }
+    fprintf(fp, "\"pid\":%d,\"tid\":%d}", pid, ring.tid);
+  }
+
+  auto print_histograms() -> void {
+    const TscClock &clock = TscClock::get();
+    printf("===== Trace scopes =====\n");
+    for (auto &[name, h] : histograms) {
+      printf("%s: %lu calls, mean %s, p50 %s, p99 %s, max %s\n", name.c_str(),
+             h.count, format_ns(clock.ns((f64)h.sum / h.count)).c_str(),
+             format_ns(clock.ns(h.percentile(0.5))).c_str(),
+             format_ns(clock.ns(h.percentile(0.99))).c_str(),
+             format_ns(clock.ns(h.max)).c_str());
+    }
+    u64 dropped = 0;
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &ring : rings) {
+      dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+    if (dropped) {
+      printf("Dropped: %lu records (rings full)\n", dropped);
+    }
+  }
+
+  std::mutex lock;
+  std::vector<std::unique_ptr<TraceRing>> rings;
+  bool running = false;
+  std::thread flusher;
+  FILE *fp = nullptr;
+  bool first_event = true;
+  int pid = 0;
+  u64 origin = 0;
+  // By name, as equal literals of different files may differ in address
+  std::map<std::string, TraceHistogram> histograms;
+};
+
+inline auto trace_push(const char *name, u64 begin, u64 end, TraceKind kind)
+    -> void {
+  TraceRing *ring = trace_ring;
+  if (__builtin_expect(!ring, 0)) {
+    ring = Tracer::get().register_thread();
+  }
+  // Either stop() sees `pushing` and waits, or this sees tracing stopped
+  ring->pushing.store(true, std::memory_order_seq_cst);
+  if (trace_enabled.load(std::memory_order_seq_cst)) {
+    ring->push({name, begin, end, kind});
+  }
+  ring->pushing.store(false, std::memory_order_release);
+}
+
+// Start tracing into a Chrome trace-event JSON file
+inline auto trace_start(const char *path) -> bool {
+  return Tracer::get().start(path);
+}
+
+// Stop tracing, finish the file and print the histograms
+inline auto trace_stop() -> void { Tracer::get().stop(); }
+
+// Records the lifetime of the enclosing scope
+class TraceScope {
+public:
+  explicit TraceScope(const char *name)
+      : name(trace_enabled.load(std::memory_order_relaxed) ? name : nullptr),
+        begin(this->name ? __rdtsc() : 0) {}
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+  ~TraceScope() {
+    if (name) {
+      trace_push(name, begin, __rdtsc(), TraceKind::Complete);
+    }
+  }
+
+private:
+  const char *name;
+  u64 begin;
+};
+
+// Begin and end markers, for spans that do not follow a C++ scope
+inline auto trace_begin(const char *name) -> void {
+  if (trace_enabled.load(std::memory_order_relaxed)) {
+    trace_push(name, __rdtsc(), 0, TraceKind::Begin);
+  }
+}
+
+inline auto trace_end(const char *name) -> void {
+  if (trace_enabled.load(std::memory_order_relaxed)) {
+    trace_push(name, __rdtsc(), 0, TraceKind::End);
+  }
+}
+
+#define CSPM_CONCAT_(a, b) a##b
+#define CSPM_CONCAT(a, b) CSPM_CONCAT_(a, b)
+
+#ifdef CSPM_TRACE_DISABLE
+#define CSPM_SCOPE(name)
+#define CSPM_TRACE_BEGIN(name)
+#define CSPM_TRACE_END(name)
+#else
+#define CSPM_SCOPE(name) TraceScope CSPM_CONCAT(cspm_scope_, __LINE__)(name)
+#define CSPM_TRACE_BEGIN(name) trace_begin(name)
+#define CSPM_TRACE_END(name) trace_end(name)
+#endif
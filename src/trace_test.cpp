@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+// Checks of trace.hpp: nested scopes and markers from several threads,
+// then the exported Chrome trace must parse and keep the nesting.
+
+static const char *trace_file = "trace_test.json";
+static const u32 THREADS = 4;
+// Four records a round: all of them fit in a ring, none is dropped
+static const u32 ROUNDS = 1000;
+static_assert(ROUNDS * 4 <= TraceRing::CAPACITY, "rounds overflow a ring");
+
+// One trace event, the fields the checks look at
+struct Event {
+  std::string name;
+  std::string phase;
+  f64 ts = -1;
+  f64 dur = -1;
+  int tid = -1;
+};
+
+// Minimal JSON reader for the trace file: an array of flat objects with
+// string and number values. Any other syntax fails the parse.
+class Parser {
+public:
+  explicit Parser(const std::string &text) : text(text) {}
+
+  auto parse(std::vector<Event> &events) -> bool {
+    if (!take('[')) {
+      return false;
+    }
+    if (!take(']')) {
+      do {
+        Event event;
+        if (!object(event)) {
+          return false;
+        }
+        events.push_back(event);
+      } while (take(','));
+      if (!take(']')) {
+        return false;
+      }
+    }
+    skip();
+    return pos == text.size();
+  }
+
+private:
+  auto skip() -> void {
+    while (pos < text.size() && strchr(" \t\r\n", text[pos])) {
+      ++pos;
+    }
+  }
+
+  auto take(char c) -> bool {
+    skip();
+    if (pos < text.size() && text[pos] == c) {
+      ++pos;
+      return true;
+    }
+    return false;
+  }
+
+  auto string(std::string &out) -> bool {
+    if (!take('"')) {
+      return false;
+    }
+    for (; pos < text.size() && text[pos] != '"'; ++pos) {
+      if (text[pos] == '\\' && ++pos == text.size()) {
+        return false;
+      }
+      out += text[pos];
+    }
+    return take('"');
+  }
+
+  auto number(f64 &out) -> bool {
+    skip();
+    const char *start = text.c_str() + pos;
+    char *end;
+    out = strtod(start, &end);
+    pos += end - start;
+    return end != start;
+  }
+
+  auto object(Event &event) -> bool {
+    if (!take('{')) {
+      return false;
+    }
+    do {
+      std::string key, value;
+      f64 n;
+      if (!string(key) || !take(':')) {
+        return false;
+      }
+      skip();
+      if (pos < text.size() && text[pos] == '"') {
+        if (!string(value)) {
+          return false;
+        }
+        if (key == "name") {
+          event.name = value;
+        } else if (key == "ph") {
+          event.phase = value;
+        }
+      } else if (number(n)) {
+        if (key == "ts") {
+          event.ts = n;
+        } else if (key == "dur") {
+          event.dur = n;
+        } else if (key == "tid") {
+          event.tid = (int)n;
+        }
+      } else {
+        return false;
+      }
+    } while (take(','));
+    return take('}');
+  }
+
+  const std::string &text;
+  size_t pos = 0;
+};
+
+static auto check(bool ok, const char *what) -> int {
+  printf("CSPM: [%s] %s\n", ok ? "INFO" : "ERROR", what);
+  return ok ? 0 : 1;
+}
+
+// The traced workload of one thread
+static auto work() -> void {
+  volatile u64 sum = 0;
+  for (u32 i = 0; i < ROUNDS; ++i) {
+    CSPM_SCOPE("outer");
+    CSPM_TRACE_BEGIN("marker");
+    {
+      CSPM_SCOPE("inner \"quoted\"");
+      for (u32 j = 0; j < 100; ++j) {
+        sum = sum + j;
+      }
+    }
+    CSPM_TRACE_END("marker");
+  }
+}
+
+auto main() -> int {
+  if (!trace_start(trace_file)) {
+    return 1;
+  }
+  std::vector<std::thread> threads;
+  for (u32 i = 0; i < THREADS; ++i) {
+    threads.emplace_back(work);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  trace_stop();
+
+  FILE *fp = fopen(trace_file, "r");
+  if (!fp) {
+    printf("CSPM: [ERROR] No trace written to %s\n", trace_file);
+    return 1;
+  }
+  std::string text;
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), fp)) > 0;) {
+    text.append(buf, n);
+  }
+  fclose(fp);
+
+  int failed = 0;
+  std::vector<Event> events;
+  failed += check(Parser(text).parse(events), "the trace is valid JSON");
+
+  std::map<int, u32> outer, inner, begins, ends;
+  bool nested = true;
+  for (const Event &event : events) {
+    if (event.phase == "X" && event.name == "outer") {
+      ++outer[event.tid];
+    } else if (event.phase == "X" && event.name == "inner \"quoted\"") {
+      ++inner[event.tid];
+    } else if (event.phase == "B" && event.name == "marker") {
+      ++begins[event.tid];
+    } else if (event.phase == "E" && event.name == "marker") {
+      ++ends[event.tid];
+    }
+  }
+  // Complete events are written when they end: an inner scope comes before
+  // its outer one and lies within it
+  std::map<int, Event> pending;
+  for (const Event &event : events) {
+    if (event.phase != "X") {
+      continue;
+    }
+    if (event.name != "outer") {
+      pending[event.tid] = event;
+      continue;
+    }
+    auto it = pending.find(event.tid);
+    if (it != pending.end()) {
+      const Event &in = it->second;
+      nested = nested && in.ts >= event.ts - 1e-3 &&
+               in.ts + in.dur <= event.ts + event.dur + 1e-3;
+      pending.erase(it);
+    }
+  }
+
+  bool counts = outer.size() == THREADS;
+  for (auto &[tid, n] : outer) {
+    counts = counts && n == ROUNDS && inner[tid] == ROUNDS &&
+             begins[tid] == ROUNDS && ends[tid] == ROUNDS;
+  }
+  failed += check(counts, "every scope and marker of every thread");
+  failed += check(nested, "inner scopes lie within their outer scope");
+
+  remove(trace_file);
+  return failed ? 1 : 0;
+}